@@ -0,0 +1,278 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "renderThread.h"
+
+#include <fstream>
+#include <sstream>
+
+
+const char* tuneProfilePath = "tune_profiles.txt";
+
+// Shrinks the trace workgroup until the device and the compiled kernel accept it
+void fitLocalSize(AppState* state) {
+
+    size_t maxLocal = state->kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(state->device);
+    std::vector<size_t> maxItems = state->device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+
+    if (maxItems.size() >= 2) {
+        while (state->localX > (int)maxItems[0] && state->localX > 1) state->localX /= 2;
+        while (state->localY > (int)maxItems[1] && state->localY > 1) state->localY /= 2;
+    }
+    while ((size_t)(state->localX * state->localY) > maxLocal && state->localX * state->localY > 1) {
+        if (state->localY > 1) state->localY /= 2;
+        else state->localX /= 2;
+    }
+}
+
+// sample counts per launch must split a frame evenly, and keep half accumulation within its pass limit
+bool validSamplesPerThread(const AppState* state, int samplesPerThread) {
+
+    if (samplesPerThread <= 0 || state->maxSamples % samplesPerThread != 0) {
+        return false;
+    }
+    return state->accumFormat != AccumFormat::Half || state->maxSamples / samplesPerThread <= 8;
+}
+
+// profiles are keyed by device name, driver version and launch mode, the mode field keeps either key from being a prefix of the other:
+// "<device>|<driver>|standard|localX localY samplesPerThread"
+// "<device>|<driver>|persistent|localX localY samplesPerThread localSize groupsPerCU"
+std::string tuneProfileKey(const AppState* state) {
+    std::string key = state->device.getInfo<CL_DEVICE_NAME>() + "|" + state->device.getInfo<CL_DRIVER_VERSION>();
+    return key + (state->persistentThreads ? "|persistent" : "|standard");
+}
+
+bool loadTuneProfile(AppState* state) {
+
+    std::ifstream file(tuneProfilePath);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::string key = tuneProfileKey(state) + "|";
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.compare(0, key.size(), key) != 0) {
+            continue;
+        }
+
+        std::istringstream values(line.substr(key.size()));
+        int localX, localY, samplesPerThread;
+        if (!(values >> localX >> localY >> samplesPerThread) || localX <= 0 || localY <= 0) {
+            return false;
+        }
+
+        state->localX = localX;
+        state->localY = localY;
+        if (validSamplesPerThread(state, samplesPerThread)) {
+            state->samplesPerThread = samplesPerThread;
+        }
+
+        size_t persistentLocal, groupsPerCU;
+        if (state->persistentThreads && values >> persistentLocal >> groupsPerCU && persistentLocal > 0 && groupsPerCU > 0) {
+            state->persistentLocalSize = persistentLocal;
+            state->persistentGroupsPerCU = groupsPerCU;
+        }
+        return true;
+    }
+    return false;
+}
+
+void saveTuneProfile(const AppState* state) {
+
+    std::string key = tuneProfileKey(state) + "|";
+    std::vector<std::string> lines;
+
+    std::ifstream in(tuneProfilePath);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.compare(0, key.size(), key) != 0) {
+            lines.push_back(line);
+        }
+    }
+    in.close();
+
+    std::string values = std::to_string(state->localX) + " " + std::to_string(state->localY) + " " + std::to_string(state->samplesPerThread);
+    if (state->persistentThreads) {
+        values += " " + std::to_string(state->persistentLocalSize) + " " + std::to_string(state->persistentGroupsPerCU);
+    }
+    lines.push_back(key + values);
+
+    std::ofstream out(tuneProfilePath, std::ios::trunc);
+    for (const std::string& l : lines) {
+        out << l << "\n";
+    }
+}
+
+// device time in ns of one full frame (clear + all trace launches), measured with profiling events
+cl_ulong timeCalibrationFrame(AppState* state) {
+
+    cl::NDRange local(state->localX, state->localY);
+    cl::NDRange global_size(roundUp(state->width, state->localX), roundUp(state->height, state->localY));
+
+    std::vector<cl::Event> events(state->maxSamples / state->samplesPerThread + 1);
+
+    state->kernel.setArg(0, 0);
+    state->queue.enqueueNDRangeKernel(state->kernel, cl::NullRange, global_size, local, nullptr, &events[0]);
+
+    state->kernel.setArg(0, 1);
+    for (size_t i = 1; i < events.size(); i++) {
+        state->queue.enqueueNDRangeKernel(state->kernel, cl::NullRange, global_size, local, nullptr, &events[i]);
+    }
+    state->queue.finish();
+
+    return events.back().getProfilingInfo<CL_PROFILING_COMMAND_END>() - events.front().getProfilingInfo<CL_PROFILING_COMMAND_START>();
+}
+
+// device time in ns of one persistent launch covering the whole frame
+cl_ulong timePersistentFrame(AppState* state) {
+
+    cl::Event event;
+    state->queue.enqueueFillBuffer(state->cl_workCounter, (cl_int)0, 0, sizeof(cl_int));
+    state->queue.enqueueNDRangeKernel(state->persistentKernel, cl::NullRange, cl::NDRange(state->persistentGlobalSize), cl::NDRange(state->persistentLocalSize), nullptr, &event);
+    state->queue.finish();
+
+    return event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+}
+
+// --persistent variant of autotune: sweeps the persistent workgroup size, groups per compute unit and samples per batch
+void autotunePersistent(AppState* state) {
+
+    const size_t localSizes[] = { 32, 64, 128, 256, 512, 1024 };
+    const size_t groupsCandidates[] = { 1, 2, 4, 8, 16 };
+    const int samplesCandidates[] = { 1, 2, 4, 8, 16, 32, 48, 96 };
+    const int repeats = 3;
+
+    size_t maxLocal = state->persistentKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(state->device);
+
+    size_t bestLocal = state->persistentLocalSize;
+    size_t bestGroups = state->persistentGroupsPerCU;
+    int bestSamples = state->samplesPerThread;
+    cl_ulong bestTime = std::numeric_limits<cl_ulong>::max();
+
+    setTraceArgs(state);
+    state->persistentKernel.setArg(14, 0);
+
+    std::cout << "Auto-tuning persistent launch configuration...\n";
+    for (size_t localSize : localSizes) {
+        if (localSize > maxLocal) {
+            continue;
+        }
+        for (size_t groups : groupsCandidates) {
+            for (int samples : samplesCandidates) {
+                if (!validSamplesPerThread(state, samples)) {
+                    continue;
+                }
+
+                state->persistentLocalSize = localSize;
+                state->persistentGroupsPerCU = groups;
+                initPersistentLaunch(state);
+                state->persistentKernel.setArg(7, state->maxSamples / samples);
+                state->persistentKernel.setArg(8, samples);
+
+                try {
+                    timePersistentFrame(state); //warm up
+                    cl_ulong time = std::numeric_limits<cl_ulong>::max();
+                    for (int r = 0; r < repeats; r++) {
+                        time = std::min(time, timePersistentFrame(state));
+                    }
+
+                    std::cout << "  " << groups << " groups of " << localSize << " per compute unit, " << samples << " samples/batch: " << time / 1.0e6 << " ms\n";
+                    if (time < bestTime) {
+                        bestTime = time;
+                        bestLocal = localSize;
+                        bestGroups = groups;
+                        bestSamples = samples;
+                    }
+                }
+                catch (const cl::Error& e) {
+                    std::cout << "  " << groups << " groups of " << localSize << " per compute unit, " << samples << " samples/batch: failed (" << e.err() << ")\n";
+                }
+            }
+        }
+    }
+
+    state->persistentLocalSize = bestLocal;
+    state->persistentGroupsPerCU = bestGroups;
+    state->samplesPerThread = bestSamples;
+    initPersistentLaunch(state);
+
+    std::cout << "Best: " << bestGroups << " groups of " << bestLocal << " per compute unit, " << bestSamples << " samples/batch ("
+              << bestTime / 1.0e6 << " ms)\n";
+    saveTuneProfile(state);
+}
+
+// Sweeps workgroup shapes and samples per launch on the startup scene, keeps the fastest and saves it for this device.
+// Launches per frame follow from samples per launch, maxSamples stays fixed so every candidate renders the same image quality.
+// With --persistent the persistent launch is tuned instead, see autotunePersistent.
+// Needs a queue created with CL_QUEUE_PROFILING_ENABLE.
+void autotune(AppState* state) {
+
+    if (state->persistentThreads) {
+        initPersistentLaunch(state);
+        autotunePersistent(state);
+        return;
+    }
+
+    const int localShapes[][2] = {
+        { 8, 8 }, { 16, 4 }, { 16, 8 }, { 16, 16 }, { 32, 2 }, { 32, 4 }, { 32, 8 },
+        { 64, 1 }, { 64, 2 }, { 64, 4 }, { 128, 1 }, { 128, 2 }, { 256, 1 }
+    };
+    const int samplesCandidates[] = { 1, 2, 4, 8, 16, 32, 48, 96 };
+    const int repeats = 3;
+
+    size_t maxLocal = state->kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(state->device);
+
+    int bestX = state->localX;
+    int bestY = state->localY;
+    int bestSamples = state->samplesPerThread;
+    cl_ulong bestTime = std::numeric_limits<cl_ulong>::max();
+
+    setTraceArgs(state);
+
+    std::cout << "Auto-tuning launch configuration...\n";
+    for (const auto& shape : localShapes) {
+        if ((size_t)(shape[0] * shape[1]) > maxLocal) {
+            continue;
+        }
+        for (int samples : samplesCandidates) {
+            if (!validSamplesPerThread(state, samples)) {
+                continue;
+            }
+
+            state->localX = shape[0];
+            state->localY = shape[1];
+            state->samplesPerThread = samples;
+            state->kernel.setArg(11, samples);
+
+            try {
+                timeCalibrationFrame(state); //warm up
+                cl_ulong time = std::numeric_limits<cl_ulong>::max();
+                for (int r = 0; r < repeats; r++) {
+                    time = std::min(time, timeCalibrationFrame(state));
+                }
+
+                std::cout << "  local " << shape[0] << "x" << shape[1] << ", " << samples << " samples/launch: " << time / 1.0e6 << " ms\n";
+                if (time < bestTime) {
+                    bestTime = time;
+                    bestX = shape[0];
+                    bestY = shape[1];
+                    bestSamples = samples;
+                }
+            }
+            catch (const cl::Error& e) {
+                std::cout << "  local " << shape[0] << "x" << shape[1] << ", " << samples << " samples/launch: failed (" << e.err() << ")\n";
+            }
+        }
+    }
+
+    state->localX = bestX;
+    state->localY = bestY;
+    state->samplesPerThread = bestSamples;
+
+    std::cout << "Best: local " << bestX << "x" << bestY << ", " << bestSamples << " samples/launch, "
+              << state->maxSamples / bestSamples << " launches/frame (" << bestTime / 1.0e6 << " ms)\n";
+    saveTuneProfile(state);
+}
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+
+// Node layout shared with bvhNode in common.cl.
+// Leaves have count >= 0 and cover items [leftFirst, leftFirst + count), an empty geometry gives a single leaf with count 0.
+// Inner nodes have count -1 and their children at leftFirst and leftFirst + 1.
+struct BVHNode {
+    cl_float3 boundsMin;
+    cl_float3 boundsMax;
+    cl_int leftFirst;
+    cl_int count;
+    cl_int pad[2];
+};
+
+// Entries in the kernels' traversal stacks, passed as -DBVH_STACK_SIZE. Walking a BVH of depth d needs d + 1 entries.
+const int bvhStackSize = 32;
+
+struct Bounds {
+    float min[3] = {  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max() };
+    float max[3] = { -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+
+    static Bounds sphere(const cl_float3& center, float radius) {
+        Bounds b;
+        for (int a = 0; a < 3; a++) {
+            b.min[a] = center.s[a] - radius;
+            b.max[a] = center.s[a] + radius;
+        }
+        return b;
+    }
+
+    void grow(const Bounds& other) {
+        for (int a = 0; a < 3; a++) {
+            min[a] = std::min(min[a], other.min[a]);
+            max[a] = std::max(max[a], other.max[a]);
+        }
+    }
+
+    float centroid(int axis) const {
+        return 0.5f * (min[axis] + max[axis]);
+    }
+};
+
+// Fills the already allocated nodes[nodeIndex] over order[first, first + count).
+// Recursive midpoint split on the axis with the widest spread of centroids, falls back to a median split when all items land on one side.
+void buildBVHNode(std::vector<BVHNode>& nodes, int nodeIndex, std::vector<int>& order, const std::vector<Bounds>& bounds,
+                  int first, int count, int indexOffset, int maxLeafSize) {
+
+    Bounds nodeBounds;
+    Bounds centroidBounds;
+    for (int i = first; i < first + count; i++) {
+        const Bounds& b = bounds[order[i]];
+        nodeBounds.grow(b);
+
+        Bounds c;
+        for (int a = 0; a < 3; a++) {
+            c.min[a] = c.max[a] = b.centroid(a);
+        }
+        centroidBounds.grow(c);
+    }
+
+    for (int a = 0; a < 3; a++) {
+        nodes[nodeIndex].boundsMin.s[a] = nodeBounds.min[a];
+        nodes[nodeIndex].boundsMax.s[a] = nodeBounds.max[a];
+    }
+
+    if (count <= maxLeafSize) {
+        nodes[nodeIndex].leftFirst = first + indexOffset;
+        nodes[nodeIndex].count = count;
+        return;
+    }
+
+    int axis = 0;
+    for (int a = 1; a < 3; a++) {
+        if (centroidBounds.max[a] - centroidBounds.min[a] > centroidBounds.max[axis] - centroidBounds.min[axis]) {
+            axis = a;
+        }
+    }
+
+    float split = 0.5f * (centroidBounds.min[axis] + centroidBounds.max[axis]);
+    int* begin = order.data() + first;
+    int* end = begin + count;
+    int* middle = std::partition(begin, end, [&](int item) { return bounds[item].centroid(axis) < split; });
+
+    if (middle == begin || middle == end) {
+        middle = begin + count / 2;
+        std::nth_element(begin, middle, end, [&](int a, int b) { return bounds[a].centroid(axis) < bounds[b].centroid(axis); });
+    }
+
+    int leftCount = (int)(middle - begin);
+
+    //children are stored next to each other so the kernel only needs the index of the left one
+    int leftChild = (int)nodes.size();
+    nodes.push_back(BVHNode{});
+    nodes.push_back(BVHNode{});
+    nodes[nodeIndex].leftFirst = leftChild;
+    nodes[nodeIndex].count = -1;
+
+    buildBVHNode(nodes, leftChild, order, bounds, first, leftCount, indexOffset, maxLeafSize);
+    buildBVHNode(nodes, leftChild + 1, order, bounds, first + leftCount, count - leftCount, indexOffset, maxLeafSize);
+}
+
+// Appends a BVH over order[first, first + count) to nodes and returns its root index.
+// order is permuted so every leaf is a contiguous range of it, leaf ranges are stored with indexOffset added
+// so they can point straight into a larger array.
+int buildBVH(std::vector<BVHNode>& nodes, std::vector<int>& order, const std::vector<Bounds>& bounds,
+             int first, int count, int indexOffset, int maxLeafSize = 2) {
+
+    int root = (int)nodes.size();
+    nodes.push_back(BVHNode{});
+    buildBVHNode(nodes, root, order, bounds, first, count, indexOffset, maxLeafSize);
+    return root;
+}
+
+// edges from nodes[root] down to its deepest leaf
+int bvhDepth(const std::vector<BVHNode>& nodes, int root) {
+    const BVHNode& node = nodes[root];
+    if (node.count >= 0) {
+        return 0;
+    }
+    return 1 + std::max(bvhDepth(nodes, node.leftFirst), bvhDepth(nodes, node.leftFirst + 1));
+}
+
+#endif
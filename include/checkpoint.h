@@ -0,0 +1,202 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "sdlUtils.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+
+// File layout: CheckpointHeader, then accumBytes of cl_AccumBuffer and seedBytes of cl_seedsBuffer, both raw.
+// Every pixel gets the same number of samples, so one count covers the whole image.
+struct CheckpointHeader {
+    char magic[4] = { 'R', 'T', 'C', 'K' };
+    uint32_t version = 1;
+    int32_t width = 0;
+    int32_t height = 0;
+    int32_t accumFormat = 0;
+    int32_t samplesPerThread = 0;
+    uint64_t accumulatedSamples = 0;
+    uint64_t sceneHash = 0;
+    render::CameraState camera{};
+    double lookfrom[3] = { 0, 0, 0 };
+    double lookat[3] = { 0, 0, 0 };
+    uint64_t accumBytes = 0;
+    uint64_t seedBytes = 0;
+};
+
+// FNV-1a over everything the kernel reads from the scene, a checkpoint only resumes into the same scene
+uint64_t sceneHash(const render& scene) {
+
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const void* data, size_t size) {
+        const uchar* bytes = (const uchar*)data;
+        for (size_t i = 0; i < size; i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+    };
+
+    mix(scene.spheres.data(), scene.spheres.size() * sizeof(render::SphereInfo));
+    mix(scene.materials.data(), scene.materials.size() * sizeof(render::MaterialInfo));
+    mix(scene.geometries.data(), scene.geometries.size() * sizeof(render::GeometryInfo));
+    mix(scene.blasNodes.data(), scene.blasNodes.size() * sizeof(BVHNode));
+    mix(scene.instances.data(), scene.instances.size() * sizeof(render::InstanceInfo));
+    mix(scene.tlasNodes.data(), scene.tlasNodes.size() * sizeof(BVHNode));
+    mix(scene.tlasIndices.data(), scene.tlasIndices.size() * sizeof(cl_int));
+    mix(scene.lights.data(), scene.lights.size() * sizeof(render::LightInfo));
+    mix(&scene.totalLightPower, sizeof(scene.totalLightPower));
+    return hash;
+}
+
+CheckpointHeader makeCheckpointHeader(AppState* state, const CameraUpdate& camera, long long accumulatedSamples) {
+
+    CheckpointHeader header;
+    header.width = state->width;
+    header.height = state->height;
+    header.accumFormat = static_cast<int32_t>(state->accumFormat);
+    header.samplesPerThread = state->samplesPerThread;
+    header.accumulatedSamples = (uint64_t)accumulatedSamples;
+    header.sceneHash = sceneHash(state->renderScene);
+    header.camera = camera.info;
+    for (int i = 0; i < 3; i++) {
+        header.lookfrom[i] = camera.lookfrom[i];
+        header.lookat[i] = camera.lookat[i];
+    }
+    header.accumBytes = (uint64_t)state->width * state->height * accumBytesPerPixel(state->accumFormat);
+    header.seedBytes = (uint64_t)state->width * state->height * sizeof(int);
+    return header;
+}
+
+// Snapshots the device buffers with non-blocking reads on the render queue and writes the file on its own thread,
+// so tracing keeps going while the data is copied and written. Only one checkpoint is in flight at a time.
+class CheckpointWriter {
+
+    CheckpointHeader header;
+    std::vector<uchar> accum;
+    std::vector<uchar> seeds;
+    cl::Event accumRead;
+    cl::Event seedsRead;
+    std::thread worker;
+    std::atomic<bool> writing{ false };
+    std::chrono::steady_clock::time_point lastWrite = std::chrono::steady_clock::now();
+
+    static void writeFile(CheckpointWriter* self, std::string path) {
+
+        try {
+            self->accumRead.wait();
+            self->seedsRead.wait();
+
+            //write next to the old checkpoint and swap, a crash mid-write keeps the previous one intact
+            std::string tempPath = path + ".tmp";
+            {
+                std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+                file.write((const char*)&self->header, sizeof(self->header));
+                file.write((const char*)self->accum.data(), self->accum.size());
+                file.write((const char*)self->seeds.data(), self->seeds.size());
+                if (!file) {
+                    throw std::runtime_error("Failed to write " + tempPath);
+                }
+            }
+            std::filesystem::rename(tempPath, path);
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Checkpoint failed: " << e.what() << std::endl;
+        }
+
+        self->writing = false;
+    }
+
+public:
+
+    ~CheckpointWriter() {
+        wait();
+    }
+
+    bool due(int intervalSeconds) const {
+        return !writing && std::chrono::steady_clock::now() - lastWrite >= std::chrono::seconds(intervalSeconds);
+    }
+
+    // must be called on the thread that owns state->queue, between launches
+    void begin(AppState* state, const CameraUpdate& camera, long long accumulatedSamples) {
+
+        wait();
+        writing = true;
+        lastWrite = std::chrono::steady_clock::now();
+
+        header = makeCheckpointHeader(state, camera, accumulatedSamples);
+        accum.resize(header.accumBytes);
+        seeds.resize(header.seedBytes);
+
+        state->queue.enqueueReadBuffer(state->cl_AccumBuffer, CL_FALSE, 0, accum.size(), accum.data(), nullptr, &accumRead);
+        state->queue.enqueueReadBuffer(state->cl_seedsBuffer, CL_FALSE, 0, seeds.size(), seeds.data(), nullptr, &seedsRead);
+        state->queue.flush();
+
+        worker = std::thread(writeFile, this, state->checkpointPath);
+    }
+
+    void wait() {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+};
+
+// Restores accumulation, seeds and camera from a checkpoint. Called before the render thread starts.
+// The samples per launch are taken from the file too, so the resumed render adds up its batches exactly like the original run.
+bool loadCheckpoint(AppState* state) {
+
+    std::ifstream file(state->resumePath, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open checkpoint: " << state->resumePath << "\n";
+        return false;
+    }
+
+    CheckpointHeader expected = makeCheckpointHeader(state, CameraUpdate{}, 0);
+    CheckpointHeader header;
+    file.read((char*)&header, sizeof(header));
+
+    if (!file || std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version) {
+        std::cerr << "Not a checkpoint file: " << state->resumePath << "\n";
+        return false;
+    }
+    if (header.width != expected.width || header.height != expected.height || header.accumFormat != expected.accumFormat
+        || header.accumBytes != expected.accumBytes || header.seedBytes != expected.seedBytes) {
+        std::cerr << "Checkpoint was written with a different resolution or accumulation format\n";
+        return false;
+    }
+    if (header.sceneHash != expected.sceneHash) {
+        std::cerr << "Checkpoint was written for a different scene\n";
+        return false;
+    }
+
+    std::vector<uchar> accum(header.accumBytes);
+    std::vector<uchar> seeds(header.seedBytes);
+    file.read((char*)accum.data(), accum.size());
+    file.read((char*)seeds.data(), seeds.size());
+    if (!file) {
+        std::cerr << "Checkpoint is truncated: " << state->resumePath << "\n";
+        return false;
+    }
+
+    state->queue.enqueueWriteBuffer(state->cl_AccumBuffer, CL_TRUE, 0, accum.size(), accum.data());
+    state->queue.enqueueWriteBuffer(state->cl_seedsBuffer, CL_TRUE, 0, seeds.size(), seeds.data());
+
+    camera& cam = state->renderScene.cam;
+    cam.lookfrom = point3D(header.lookfrom[0], header.lookfrom[1], header.lookfrom[2]);
+    cam.lookat = point3D(header.lookat[0], header.lookat[1], header.lookat[2]);
+    cam.initialize();
+    state->renderScene.cameraInfo = header.camera;
+    state->queue.enqueueWriteBuffer(state->cl_cameraBuffer, CL_TRUE, 0, sizeof(header.camera), &header.camera);
+
+    state->samplesPerThread = header.samplesPerThread;
+    state->resumeSamples = (long long)header.accumulatedSamples;
+
+    std::cout << "Resumed from " << state->resumePath << " at " << state->resumeSamples << " samples per pixel\n";
+    return true;
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <atomic>
+
+// Lock-free single producer / single consumer triple buffer.
+// The writer fills writeBuffer() and publishes it, the reader fetches the newest published value.
+// Values that are published but never fetched are overwritten, the reader only ever sees the latest one.
+template <typename T>
+class Mailbox {
+
+    static constexpr int newBit = 4;
+
+    T slots[3];
+    std::atomic<int> shared{ 1 };
+    int writeSlot = 0;
+    int readSlot = 2;
+
+public:
+
+    void fill(const T& value) {
+        for (T& slot : slots) {
+            slot = value;
+        }
+    }
+
+    T& writeBuffer() { return slots[writeSlot]; }
+
+    void publish() {
+        writeSlot = shared.exchange(writeSlot | newBit, std::memory_order_acq_rel) & ~newBit;
+    }
+
+    bool hasNew() const {
+        return (shared.load(std::memory_order_acquire) & newBit) != 0;
+    }
+
+    //swaps the newest value into readBuffer(), false if nothing was published since the last fetch
+    bool fetch() {
+        if (!hasNew()) {
+            return false;
+        }
+        readSlot = shared.exchange(readSlot, std::memory_order_acq_rel) & ~newBit;
+        return true;
+    }
+
+    T& readBuffer() { return slots[readSlot]; }
+};
+
+#endif
@@ -1,6 +1,8 @@
 #include "utils.h"
+#include "bvh.h"
 
 #include <fstream>
+#include <numeric>
 #include <vector>
 
 
@@ -43,8 +45,55 @@ public:
 	};
 #pragma pack(pop)
 
-	SphereInfo sphereOneInfo;
-	SphereInfo sphereTwoInfo;
+	//material of the sphere at the same index, kept out of the packed SphereInfo so its float3s stay aligned
+	struct MaterialInfo {
+		cl_float3 albedo;
+		cl_float3 emission;
+	};
+
+	//entry of the light sampling table, cdf is the running sum of power / totalLightPower
+	struct LightInfo {
+		cl_float3 center;
+		cl_float3 emission;
+		cl_float radius;
+		cl_float cdf;
+		cl_float pad[2];
+	};
+
+	//shared geometry, a contiguous range of spheres in object space with its own bottom level BVH
+	struct GeometryInfo {
+		cl_int firstSphere;
+		cl_int sphereCount;
+		cl_int rootNode;
+		cl_int pad;
+	};
+
+	//placed copy of a geometry, object to world is rotation rows * scale + translation
+	//spheres stay spheres, so only rotation, uniform scale and translation are allowed
+	struct InstanceInfo {
+		cl_float3 rot0;
+		cl_float3 rot1;
+		cl_float3 rot2;
+		cl_float3 translation;
+		cl_float3 albedo;
+		cl_float3 emission;
+		cl_float scale;
+		cl_int geometry;
+		cl_int overrideMaterial;
+		cl_int pad;
+	};
+
+	std::vector<SphereInfo> spheres;
+	std::vector<MaterialInfo> materials;
+	std::vector<GeometryInfo> geometries;
+	std::vector<BVHNode> blasNodes;
+
+	std::vector<InstanceInfo> instances;
+	std::vector<BVHNode> tlasNodes;
+	std::vector<cl_int> tlasIndices;
+
+	std::vector<LightInfo> lights;
+	float totalLightPower = 0.0f;
 	
 		render(int width, int height, float camX = 0, float camY = 0.9, float camZ = 1) : m_width{ width }, m_height{height} {
 			cam.aspect_ratio = aspectRatio;
@@ -62,27 +111,229 @@ public:
 			buildCamStruct();
 
 
-			point3D sphereCenterOne = point3D(0, -200.5, -3.2);
-			float r1 = 199;
+			//unit ball, reused for the ground, the big sphere and the light
+			int ball = beginGeometry();
+			addSphere(point3D(0, 0, 0), 1, vec3(0.5, 0.5, 0.5));
 
+			//small pile of debris
+			int debris = beginGeometry();
+			addSphere(point3D(0, 0, 0), 0.1, vec3(0.6, 0.6, 0.6));
+			addSphere(point3D(0.12, -0.02, 0.02), 0.07, vec3(0.6, 0.6, 0.6));
+			addSphere(point3D(-0.07, -0.04, 0.09), 0.06, vec3(0.6, 0.6, 0.6));
 
-			point3D sphereCenterTwo = point3D(0, -0.6, -3.2);
-			float r2 = 1;
-			//sphere1
-			sphereOneInfo.m_center.x = sphereCenterOne.x();
-			sphereOneInfo.m_center.y = sphereCenterOne.y();
-			sphereOneInfo.m_center.z = sphereCenterOne.z();
-			sphereOneInfo.m_radius = r1;
-			sphereOneInfo.objID = 1;
+			//ground
+			addInstance(ball, point3D(0, -200.5, -3.2), 199, vec3(0, 1, 0), 0, vec3(0.2, 0.5, 0.0), vec3(0, 0, 0));
 
-			//sphere2
-			sphereTwoInfo.m_center.x = sphereCenterTwo.x();
-			sphereTwoInfo.m_center.y = sphereCenterTwo.y();
-			sphereTwoInfo.m_center.z = sphereCenterTwo.z();
-			sphereTwoInfo.m_radius = r2;
-			sphereTwoInfo.objID = 2;
-			
-	
+			//sphere
+			addInstance(ball, point3D(0, -0.6, -3.2), 1);
+
+			//small light
+			addInstance(ball, point3D(-1.6, 1.2, -2.4), 0.2, vec3(0, 1, 0), 0, vec3(0.0, 0.0, 0.0), vec3(40.0, 36.0, 30.0));
+
+			//ring of debris around the sphere
+			const int debrisCount = 24;
+			for (int i = 0; i < debrisCount; i++) {
+				double angle = 2.0 * pi * i / debrisCount;
+				double distance = 1.5 + 0.3 * (i % 3);
+				point3D position(distance * std::cos(angle), -1.4, -3.2 + distance * std::sin(angle));
+				double yaw = 360.0 * i / debrisCount;
+
+				if (i % 4 == 0) {
+					addInstance(debris, position, 1, vec3(0, 1, 0), yaw, vec3(0.7, 0.2, 0.1), vec3(0, 0, 0));
+				}
+				else {
+					addInstance(debris, position, 1, vec3(0, 1, 0), yaw);
+				}
+			}
+
+			buildBottomLevel();
+			buildTopLevel();
+		}
+
+		static cl_float3 toFloat3(const vec3& v) {
+			cl_float3 out{};
+			out.x = (float)v.x();
+			out.y = (float)v.y();
+			out.z = (float)v.z();
+			return out;
+		}
+
+		static float luminance(const cl_float3& c) {
+			return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+		}
+
+		// must match lightPickPdf in render.cl
+		static float lightPower(const cl_float3& emission, float radius) {
+			return luminance(emission) * 4.0f * (float)pi * radius * radius;
+		}
+
+		//following addSphere calls go into the new geometry
+		int beginGeometry() {
+			GeometryInfo geometry{};
+			geometry.firstSphere = (cl_int)spheres.size();
+			geometry.rootNode = -1;
+			geometries.push_back(geometry);
+			return (int)geometries.size() - 1;
+		}
+
+		//sphere in object space of the last geometry
+		void addSphere(const point3D& center, float radius, const vec3& albedo, const vec3& emission = vec3(0, 0, 0)) {
+			SphereInfo sphere{};
+			sphere.m_center = toFloat3(center);
+			sphere.m_radius = radius;
+			sphere.objID = (cl_int)spheres.size() + 1;
+			spheres.push_back(sphere);
+
+			MaterialInfo material{};
+			material.albedo = toFloat3(albedo);
+			material.emission = toFloat3(emission);
+			materials.push_back(material);
+			geometries.back().sphereCount++;
+		}
+
+		//instance using the materials of its geometry, rotation is angleDegrees around axis
+		int addInstance(int geometry, const point3D& position, float scale, const vec3& axis = vec3(0, 1, 0), double angleDegrees = 0) {
+
+			InstanceInfo instance{};
+			instance.geometry = geometry;
+			instance.scale = scale;
+			instance.translation = toFloat3(position);
+
+			vec3 k = unit_vector(axis);
+			double c = std::cos(degrees_to_radians(angleDegrees));
+			double s = std::sin(degrees_to_radians(angleDegrees));
+			vec3 rows[3] = {
+				vec3(c + (1 - c) * k.x() * k.x(), (1 - c) * k.x() * k.y() - s * k.z(), (1 - c) * k.x() * k.z() + s * k.y()),
+				vec3((1 - c) * k.y() * k.x() + s * k.z(), c + (1 - c) * k.y() * k.y(), (1 - c) * k.y() * k.z() - s * k.x()),
+				vec3((1 - c) * k.z() * k.x() - s * k.y(), (1 - c) * k.z() * k.y() + s * k.x(), c + (1 - c) * k.z() * k.z())
+			};
+			instance.rot0 = toFloat3(rows[0]);
+			instance.rot1 = toFloat3(rows[1]);
+			instance.rot2 = toFloat3(rows[2]);
+
+			instances.push_back(instance);
+			return (int)instances.size() - 1;
+		}
+
+		//instance with its own material for every sphere of the geometry
+		int addInstance(int geometry, const point3D& position, float scale, const vec3& axis, double angleDegrees, const vec3& albedo, const vec3& emission) {
+			int index = addInstance(geometry, position, scale, axis, angleDegrees);
+			instances[index].overrideMaterial = 1;
+			instances[index].albedo = toFloat3(albedo);
+			instances[index].emission = toFloat3(emission);
+			return index;
+		}
+
+		static cl_float3 toWorld(const InstanceInfo& instance, const cl_float3& p) {
+			cl_float3 out{};
+			out.x = (instance.rot0.x * p.x + instance.rot0.y * p.y + instance.rot0.z * p.z) * instance.scale + instance.translation.x;
+			out.y = (instance.rot1.x * p.x + instance.rot1.y * p.y + instance.rot1.z * p.z) * instance.scale + instance.translation.y;
+			out.z = (instance.rot2.x * p.x + instance.rot2.y * p.y + instance.rot2.z * p.z) * instance.scale + instance.translation.z;
+			return out;
+		}
+
+		//world bounds of the transformed corners of the geometry's root box
+		Bounds instanceBounds(const InstanceInfo& instance) const {
+
+			const BVHNode& root = blasNodes[geometries[instance.geometry].rootNode];
+			Bounds bounds;
+			for (int corner = 0; corner < 8; corner++) {
+				cl_float3 p{};
+				p.x = (corner & 1) ? root.boundsMax.x : root.boundsMin.x;
+				p.y = (corner & 2) ? root.boundsMax.y : root.boundsMin.y;
+				p.z = (corner & 4) ? root.boundsMax.z : root.boundsMin.z;
+				bounds.grow(Bounds::sphere(toWorld(instance, p), 0.0f));
+			}
+			return bounds;
+		}
+
+		//one BVH per geometry, the spheres (and their materials) of each geometry are reordered to match its leaves
+		void buildBottomLevel() {
+
+			blasNodes.clear();
+
+			for (GeometryInfo& geometry : geometries) {
+				std::vector<Bounds> bounds;
+				for (int i = 0; i < geometry.sphereCount; i++) {
+					const SphereInfo& sphere = spheres[geometry.firstSphere + i];
+					bounds.push_back(Bounds::sphere(sphere.m_center, sphere.m_radius));
+				}
+
+				std::vector<int> order(geometry.sphereCount);
+				std::iota(order.begin(), order.end(), 0);
+				geometry.rootNode = buildBVH(blasNodes, order, bounds, 0, geometry.sphereCount, geometry.firstSphere);
+
+				std::vector<SphereInfo> sorted;
+				std::vector<MaterialInfo> sortedMaterials;
+				for (int i : order) {
+					sorted.push_back(spheres[geometry.firstSphere + i]);
+					sortedMaterials.push_back(materials[geometry.firstSphere + i]);
+				}
+				std::copy(sorted.begin(), sorted.end(), spheres.begin() + geometry.firstSphere);
+				std::copy(sortedMaterials.begin(), sortedMaterials.end(), materials.begin() + geometry.firstSphere);
+			}
+		}
+
+		//BVH over the instances and the world space light table, built after the geometries
+		void buildTopLevel() {
+
+			std::vector<Bounds> bounds;
+			for (const InstanceInfo& instance : instances) {
+				bounds.push_back(instanceBounds(instance));
+			}
+
+			tlasNodes.clear();
+			tlasIndices.assign(instances.size(), 0);
+			std::iota(tlasIndices.begin(), tlasIndices.end(), 0);
+			buildBVH(tlasNodes, tlasIndices, bounds, 0, (int)instances.size(), 0);
+
+			buildLightTable();
+		}
+
+		//deepest bottom or top level BVH, each is walked with its own stack
+		int maxBVHDepth() const {
+			int depth = tlasNodes.empty() ? 0 : bvhDepth(tlasNodes, 0);
+			for (const GeometryInfo& geometry : geometries) {
+				depth = std::max(depth, bvhDepth(blasNodes, geometry.rootNode));
+			}
+			return depth;
+		}
+
+		//every emissive sphere of every instance becomes a light, picked in proportion to its power
+		void buildLightTable() {
+
+			lights.clear();
+			totalLightPower = 0.0f;
+
+			for (const InstanceInfo& instance : instances) {
+				const GeometryInfo& geometry = geometries[instance.geometry];
+
+				for (int i = geometry.firstSphere; i < geometry.firstSphere + geometry.sphereCount; i++) {
+					const SphereInfo& sphere = spheres[i];
+					cl_float3 emission = instance.overrideMaterial ? instance.emission : materials[i].emission;
+					float radius = sphere.m_radius * instance.scale;
+
+					float power = lightPower(emission, radius);
+					if (power <= 0.0f) {
+						continue;
+					}
+					totalLightPower += power;
+
+					LightInfo light{};
+					light.center = toWorld(instance, sphere.m_center);
+					light.emission = emission;
+					light.radius = radius;
+					light.cdf = totalLightPower;
+					lights.push_back(light);
+				}
+			}
+
+			for (LightInfo& light : lights) {
+				light.cdf /= totalLightPower;
+			}
+			if (!lights.empty()) {
+				lights.back().cdf = 1.0f;
+			}
 		}
 
 		void buildCamStruct() {
@@ -0,0 +1,188 @@
+#ifndef RENDERTHREAD_H
+#define RENDERTHREAD_H
+
+#include "sdlUtils.h"
+#include "checkpoint.h"
+#include "stats.h"
+
+
+void setTraceArgs(AppState* state) {
+
+    state->kernel.setArg(1, state->cl_AccumBuffer);
+    state->kernel.setArg(2, state->width);
+    state->kernel.setArg(3, state->height);
+    state->kernel.setArg(4, state->cl_cameraBuffer);
+    state->kernel.setArg(5, state->cl_spheresBuffer);
+    state->kernel.setArg(6, (int)state->renderScene.instances.size());
+    state->kernel.setArg(7, state->cl_seedsBuffer);
+    state->kernel.setArg(8, state->cl_debugBuffer);
+    state->kernel.setArg(9, state->cl_output);
+    state->kernel.setArg(10, state->maxSamples);
+    state->kernel.setArg(11, state->samplesPerThread);
+    state->kernel.setArg(12, state->cl_lightsBuffer);
+    state->kernel.setArg(13, (int)state->renderScene.lights.size());
+    state->kernel.setArg(14, state->renderScene.totalLightPower);
+    state->kernel.setArg(15, state->cl_blasBuffer);
+    state->kernel.setArg(16, state->cl_geometriesBuffer);
+    state->kernel.setArg(17, state->cl_instancesBuffer);
+    state->kernel.setArg(18, state->cl_tlasBuffer);
+    state->kernel.setArg(19, state->cl_tlasIndicesBuffer);
+    state->kernel.setArg(20, state->cl_pixelStatsBuffer);
+    state->kernel.setArg(21, state->cl_statTotalsBuffer);
+    state->kernel.setArg(22, 0);
+    state->kernel.setArg(23, 1.0f);
+    state->kernel.setArg(24, state->cl_materialsBuffer);
+
+    state->persistentKernel.setArg(0, state->cl_AccumBuffer);
+    state->persistentKernel.setArg(1, state->width);
+    state->persistentKernel.setArg(2, state->height);
+    state->persistentKernel.setArg(3, state->cl_cameraBuffer);
+    state->persistentKernel.setArg(4, state->cl_spheresBuffer);
+    state->persistentKernel.setArg(5, (int)state->renderScene.instances.size());
+    state->persistentKernel.setArg(6, state->cl_seedsBuffer);
+    state->persistentKernel.setArg(7, state->maxSamples / state->samplesPerThread);
+    state->persistentKernel.setArg(8, state->samplesPerThread);
+    state->persistentKernel.setArg(9, state->cl_lightsBuffer);
+    state->persistentKernel.setArg(10, (int)state->renderScene.lights.size());
+    state->persistentKernel.setArg(11, state->renderScene.totalLightPower);
+    state->persistentKernel.setArg(12, state->cl_workCounter);
+    state->persistentKernel.setArg(13, state->persistentItems);
+    state->persistentKernel.setArg(14, 0);
+    state->persistentKernel.setArg(15, state->cl_blasBuffer);
+    state->persistentKernel.setArg(16, state->cl_geometriesBuffer);
+    state->persistentKernel.setArg(17, state->cl_instancesBuffer);
+    state->persistentKernel.setArg(18, state->cl_tlasBuffer);
+    state->persistentKernel.setArg(19, state->cl_tlasIndicesBuffer);
+    state->persistentKernel.setArg(20, state->cl_pixelStatsBuffer);
+    state->persistentKernel.setArg(21, state->cl_statTotalsBuffer);
+    state->persistentKernel.setArg(22, state->cl_materialsBuffer);
+}
+
+void resolveFrame(AppState* state, std::vector<uchar>& pixels, long long accumulatedSamples) {
+
+    cl::NDRange local(state->localX, state->localY);
+    cl::NDRange global_size(roundUp(state->width, state->localX), roundUp(state->height, state->localY));
+
+    int heatmapMode = state->rayStats ? state->heatmapMode.load() : 0;
+
+    state->kernel.setArg(0, 2);
+    state->kernel.setArg(10, (int)accumulatedSamples);
+    state->kernel.setArg(22, heatmapMode);
+    state->kernel.setArg(23, heatmapScale(state, heatmapMode));
+    state->queue.enqueueNDRangeKernel(state->kernel, cl::NullRange, global_size, local);
+    state->queue.enqueueReadBuffer(state->cl_output, CL_TRUE, 0, pixels.size(), pixels.data());
+}
+
+// resolves cl_AccumBuffer averaged over accumulatedSamples and hands it to the main thread
+void publishFrame(AppState* state, long long accumulatedSamples) {
+    resolveFrame(state, state->frameMailbox.writeBuffer(), accumulatedSamples);
+    state->frameMailbox.publish();
+}
+
+// Traces all samples of one frame into cl_AccumBuffer, starting from a cleared buffer when accumulatedSamples is 0.
+// After a camera change the first batch is published right away, so a drag shows a noisy preview instead of the old view.
+// Waits for every batch and returns false when a newer camera arrives before the last batch, the rest of the frame is dropped.
+// accumulatedSamples counts the samples per pixel in cl_AccumBuffer, it is only carried over between frames with --progressive.
+bool traceFrame(AppState* state, long long& accumulatedSamples, bool cameraChanged) {
+
+    cl::NDRange local(state->localX, state->localY);
+    cl::NDRange global_size(roundUp(state->width, state->localX), roundUp(state->height, state->localY));
+
+    if (!state->progressive) {
+        accumulatedSamples = 0;
+    }
+
+    int batches = state->maxSamples / state->samplesPerThread;
+
+    if (state->rayStats) {
+        resetStatTotals(state);
+    }
+
+    if (state->persistentThreads) {
+        //one launch traces every batch of the frame, it is always published since it cannot be cut short
+        state->persistentKernel.setArg(14, accumulatedSamples > 0 ? 1 : 0);
+        state->queue.enqueueFillBuffer(state->cl_workCounter, (cl_int)0, 0, sizeof(cl_int));
+        state->queue.enqueueNDRangeKernel(state->persistentKernel, cl::NullRange, cl::NDRange(state->persistentGlobalSize), cl::NDRange(state->persistentLocalSize));
+        state->queue.finish();
+        accumulatedSamples += (long long)batches * state->samplesPerThread;
+        return true;
+    }
+
+    if (accumulatedSamples == 0) {
+        state->kernel.setArg(0, 0);
+        state->queue.enqueueNDRangeKernel(state->kernel, cl::NullRange, global_size, local);
+    }
+
+    for (int sample = 0; sample < batches; sample++) {
+        state->kernel.setArg(0, 1);
+        state->queue.enqueueNDRangeKernel(state->kernel, cl::NullRange, global_size, local);
+        state->queue.finish();
+        accumulatedSamples += state->samplesPerThread;
+
+        if (cameraChanged && sample == 0 && batches > 1) {
+            publishFrame(state, accumulatedSamples);
+        }
+        //a fully traced frame is always published, only the batches still to come are dropped
+        if (sample + 1 < batches && (state->cameraMailbox.hasNew() || state->quitRender.load())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Owns state->queue while running. Camera updates come in through cameraMailbox, finished frames go out through frameMailbox.
+void renderThreadMain(AppState* state) {
+
+    setTraceArgs(state);
+
+    CheckpointWriter checkpoints;
+    bool checkpointing = !state->checkpointPath.empty();
+    long long accumulatedSamples = state->resumeSamples;
+
+    while (!state->quitRender.load()) {
+        try {
+            bool cameraChanged = state->cameraMailbox.fetch();
+            if (cameraChanged) {
+                state->queue.enqueueWriteBuffer(state->cl_cameraBuffer, CL_TRUE, 0, sizeof(render::CameraState), &state->cameraMailbox.readBuffer().info);
+                accumulatedSamples = 0;
+            }
+
+            if (!traceFrame(state, accumulatedSamples, cameraChanged)) {
+                continue;
+            }
+
+            if (state->rayStats) {
+                reportStats(state);
+            }
+
+            publishFrame(state, accumulatedSamples);
+
+            if (state->rayStats && state->dumpStatsRequested.exchange(false)) {
+                dumpPixelStats(state, accumulatedSamples);
+            }
+
+            if (checkpointing && checkpoints.due(state->checkpointInterval)) {
+                checkpoints.begin(state, state->cameraMailbox.readBuffer(), accumulatedSamples);
+            }
+        }
+        catch (const cl::Error& e) {
+            std::cerr << "OpenCL runtime error: " << e.what() << " (code: " << e.err() << ")" << std::endl;
+            std::cout << "Kernel expects " << state->kernel.getInfo<CL_KERNEL_NUM_ARGS>() << " arguments" << std::endl;
+        }
+    }
+
+    state->queue.finish();
+
+    //last checkpoint on the way out, covers the batches traced since the previous one
+    if (checkpointing && accumulatedSamples > 0) {
+        try {
+            checkpoints.begin(state, state->cameraMailbox.readBuffer(), accumulatedSamples);
+            checkpoints.wait();
+        }
+        catch (const cl::Error& e) {
+            std::cerr << "OpenCL runtime error: " << e.what() << " (code: " << e.err() << ")" << std::endl;
+        }
+    }
+}
+
+#endif
@@ -1,6 +1,11 @@
 #ifndef SDLUTILS_H
 #define SDLUTILS_H
 #include "utils.h"
+#include "mailbox.h"
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
 #include <CL/opencl.hpp>
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_main.h>
@@ -8,13 +13,32 @@
 
 using uchar = unsigned char;
 
+// Layout of cl_AccumBuffer, matches ACCUM_FORMAT in render.cl
+enum class AccumFormat {
+    Float,  // float3, 16 bytes per pixel
+    Half,   // half4, 8 bytes per pixel
+    RGBE    // shared exponent, 4 bytes per pixel (lossy HDR storage, single store per frame with --persistent only)
+};
+
+// Layout of cl_output, matches OUTPUT_FORMAT in render.cl
+enum class OutputFormat {
+    RGB24,
+    RGBA8,
+    BGRA8
+};
+
+// what the render thread needs to restart with a new camera, the host side camera is kept for checkpoints
+struct CameraUpdate {
+    render::CameraState info;
+    point3D lookfrom;
+    point3D lookat;
+};
+
 struct AppState {
     //raytracer
     int width;
     int height;
 
-
-    std::vector<uchar> pixels;
     render renderScene;
 
     //SDL
@@ -26,7 +50,7 @@ struct AppState {
 
     //openCL
 
-    int* hostSeeds;
+    int* hostSeeds = nullptr;
     // OpenCL execution environment
     cl::Context context;
 
@@ -39,24 +63,71 @@ struct AppState {
     // Represents the actual computation to be executed
     cl::Kernel kernel;
 
+    // ray_trace_persistent, only used with --persistent
+    cl::Kernel persistentKernel;
+
     cl::Buffer cl_AccumBuffer;
 
     cl::Buffer cl_cameraBuffer;
 
+    //bottom level: spheres grouped into shared geometries, one BVH per geometry
     cl::Buffer cl_spheresBuffer;
+    cl::Buffer cl_materialsBuffer;
+    cl::Buffer cl_geometriesBuffer;
+    cl::Buffer cl_blasBuffer;
+
+    //top level: instances and the BVH over them, built once at startup and kept apart from the bottom level
+    cl::Buffer cl_instancesBuffer;
+    cl::Buffer cl_tlasBuffer;
+    cl::Buffer cl_tlasIndicesBuffer;
 
-    int numSpheres = 2;
-    render::SphereInfo spheres[2];
+    cl::Buffer cl_lightsBuffer;
 
     cl::Buffer cl_debugBuffer;
 
     cl::Buffer cl_seedsBuffer;
 
     cl::Buffer cl_output;
+
+    //instrumented build (--stats): per pixel counters, global totals and the heatmap shown instead of the image
+    bool rayStats = false;
+    cl::Buffer cl_pixelStatsBuffer;
+    cl::Buffer cl_statTotalsBuffer;
+    std::atomic<int> heatmapMode{ 0 };
+    std::atomic<bool> dumpStatsRequested{ false };
+    std::string statsPath = "ray_stats.csv";
+    float testsPerPath = 32.0f;
+    int statsFrames = 0;
+    int statsReportInterval = 30;
+
+    //persistent threads
+    bool persistentThreads = false;
+    cl::Buffer cl_workCounter;
+    size_t persistentLocalSize = 256;
+    size_t persistentGroupsPerCU = 4;
+    size_t persistentGlobalSize = 0;
+    int persistentItems = 0;
     
     int maxSamples = 96;
     int samplesPerThread = 16;
 
+    //trace workgroup shape, loaded from the tuning profile when there is one
+    int localX = 64;
+    int localY = 4;
+    bool autotune = false;
+
+    AccumFormat accumFormat = AccumFormat::Half;
+    OutputFormat outputFormat = OutputFormat::RGBA8;
+
+    //keep accumulating across frames while the camera does not move
+    bool progressive = false;
+
+    //checkpoints of the progressive accumulation, written by the render thread
+    std::string checkpointPath;
+    int checkpointInterval = 300;
+    std::string resumePath;
+    long long resumeSamples = 0;
+
 
     bool moving = false;
 
@@ -73,7 +144,12 @@ struct AppState {
     float currentVirtualY = windowCenterY;
 
     bool ignoringEvents = false;
-    bool cameraNeedsUpdate = false;
+
+    //render thread, owns the queue once started
+    std::thread renderThread;
+    std::atomic<bool> quitRender{ false };
+    Mailbox<CameraUpdate> cameraMailbox;
+    Mailbox<std::vector<uchar>> frameMailbox;
 
     Uint8 data[1] = { 0 };
     Uint8 mask[1] = { 0 };
@@ -82,13 +158,117 @@ struct AppState {
 };
 
 
+inline size_t roundUp(size_t value, size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+size_t accumBytesPerPixel(AccumFormat format) {
+    switch (format) {
+    case AccumFormat::Half: return 4 * sizeof(cl_half);
+    case AccumFormat::RGBE: return sizeof(cl_uint);
+    default:                return sizeof(cl_float3);
+    }
+}
+
+size_t outputBytesPerPixel(OutputFormat format) {
+    return format == OutputFormat::RGB24 ? 3 * sizeof(uchar) : sizeof(cl_uint);
+}
+
+// Packed 32 bit values are written little endian by the kernel, so RGBA8 is R,G,B,A in memory
+SDL_PixelFormat sdlPixelFormat(OutputFormat format) {
+    switch (format) {
+    case OutputFormat::RGBA8: return SDL_PIXELFORMAT_RGBA32;
+    case OutputFormat::BGRA8: return SDL_PIXELFORMAT_BGRA32;
+    default:                  return SDL_PIXELFORMAT_RGB24;
+    }
+}
+
+std::string kernelBuildOptions(const AppState* state) {
+    std::string options;
+    options += "-DACCUM_FORMAT=" + std::to_string(static_cast<int>(state->accumFormat));
+    options += " -DOUTPUT_FORMAT=" + std::to_string(static_cast<int>(state->outputFormat));
+    options += " -DBVH_STACK_SIZE=" + std::to_string(bvhStackSize);
+    if (state->rayStats) {
+        options += " -DRAY_STATS";
+    }
+    return options;
+}
+
+//command line: --accum=float|half|rgbe --output=rgb24|rgba8|bgra8 --persistent --autotune
+//              --progressive --checkpoint=<file> --checkpoint-interval=<seconds> --resume=<file>
+//              --stats --heatmap=bounces|tests|sky|depth --stats-file=<file>
+void parseArgs(AppState* state, int argc, char** argv) {
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        std::string value = arg.substr(arg.find('=') + 1);
+
+        if (arg == "--accum=float")      state->accumFormat = AccumFormat::Float;
+        else if (arg == "--accum=half")  state->accumFormat = AccumFormat::Half;
+        else if (arg == "--accum=rgbe")  state->accumFormat = AccumFormat::RGBE;
+        else if (arg == "--output=rgb24") state->outputFormat = OutputFormat::RGB24;
+        else if (arg == "--output=rgba8") state->outputFormat = OutputFormat::RGBA8;
+        else if (arg == "--output=bgra8") state->outputFormat = OutputFormat::BGRA8;
+        else if (arg == "--persistent")   state->persistentThreads = true;
+        else if (arg == "--autotune")     state->autotune = true;
+        else if (arg == "--progressive")  state->progressive = true;
+        else if (arg.rfind("--checkpoint=", 0) == 0)          state->checkpointPath = value;
+        else if (arg.rfind("--checkpoint-interval=", 0) == 0) state->checkpointInterval = std::max(1, std::atoi(value.c_str()));
+        else if (arg.rfind("--resume=", 0) == 0)              state->resumePath = value;
+        else if (arg == "--stats")                            state->rayStats = true;
+        else if (arg == "--heatmap=bounces")                  state->heatmapMode = 1;
+        else if (arg == "--heatmap=tests")                    state->heatmapMode = 2;
+        else if (arg == "--heatmap=sky")                      state->heatmapMode = 3;
+        else if (arg == "--heatmap=depth")                    state->heatmapMode = 4;
+        else if (arg.rfind("--stats-file=", 0) == 0)          state->statsPath = value;
+        else std::cerr << "Unknown argument: " << arg << "\n";
+    }
+
+    //heatmaps read the counters of the instrumented kernels
+    if (state->heatmapMode > 0) {
+        state->rayStats = true;
+    }
+
+    //RGBE keeps about 8 mantissa bits, so it is only written once per frame (persistent path) and never used as a running sum
+    if (state->accumFormat == AccumFormat::RGBE && !state->persistentThreads) {
+        std::cout << "RGBE accumulation needs --persistent, using float accumulation\n";
+        state->accumFormat = AccumFormat::Float;
+    }
+
+    //checkpoints only make sense for an accumulation that outlives a frame
+    if (!state->checkpointPath.empty() || !state->resumePath.empty()) {
+        state->progressive = true;
+    }
+    if (state->progressive && state->accumFormat != AccumFormat::Float) {
+        std::cout << "Progressive accumulation needs full precision, using float accumulation\n";
+        state->accumFormat = AccumFormat::Float;
+    }
+
+    // half sums lose about 1/2048 of their value per add, keep the number of adds per pixel small
+    int launches = state->maxSamples / state->samplesPerThread;
+    if (state->accumFormat == AccumFormat::Half && launches > 8) {
+        std::cout << "Too many accumulation passes for half precision, using float accumulation\n";
+        state->accumFormat = AccumFormat::Float;
+    }
+}
+
+
+// read only scene buffer, kernels skip empty arrays by their count but still need a valid buffer
+template <typename T>
+cl::Buffer sceneBuffer(const cl::Context& context, std::vector<T> data) {
+    if (data.empty()) {
+        data.push_back(T{});
+    }
+    return cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, data.size() * sizeof(T), data.data());
+}
+
 void initBuffers(AppState* state) {
 
     //accumulating samples
-    state->cl_AccumBuffer = cl::Buffer(state->context, CL_MEM_READ_WRITE, state->width * state->height * sizeof(cl_float3));
+    state->cl_AccumBuffer = cl::Buffer(state->context, CL_MEM_READ_WRITE, state->width * state->height * accumBytesPerPixel(state->accumFormat));
 
     //output to textures
-    state->cl_output = cl::Buffer(state->context, CL_MEM_READ_WRITE, state->width * state->height * (sizeof(uchar)) * 3);
+    state->cl_output = cl::Buffer(state->context, CL_MEM_READ_WRITE, state->width * state->height * outputBytesPerPixel(state->outputFormat));
 
     //debug in host
     state->cl_debugBuffer = cl::Buffer(state->context, CL_MEM_WRITE_ONLY, 10 * sizeof(cl_float));
@@ -96,10 +276,17 @@ void initBuffers(AppState* state) {
     //camera
     state->cl_cameraBuffer = cl::Buffer(state->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(state->renderScene.cameraInfo), &state->renderScene.cameraInfo);
 
-    //spheres
-    state->spheres[0] = state->renderScene.sphereOneInfo;
-    state->spheres[1] = state->renderScene.sphereTwoInfo;
-    state->cl_spheresBuffer = cl::Buffer(state->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 2 * sizeof(render::SphereInfo), &state->spheres);
+    //geometry
+    state->cl_spheresBuffer = sceneBuffer(state->context, state->renderScene.spheres);
+    state->cl_materialsBuffer = sceneBuffer(state->context, state->renderScene.materials);
+    state->cl_geometriesBuffer = sceneBuffer(state->context, state->renderScene.geometries);
+    state->cl_blasBuffer = sceneBuffer(state->context, state->renderScene.blasNodes);
+
+    //instances and lights
+    state->cl_instancesBuffer = sceneBuffer(state->context, state->renderScene.instances);
+    state->cl_tlasBuffer = sceneBuffer(state->context, state->renderScene.tlasNodes);
+    state->cl_tlasIndicesBuffer = sceneBuffer(state->context, state->renderScene.tlasIndices);
+    state->cl_lightsBuffer = sceneBuffer(state->context, state->renderScene.lights);
 
     //random number seed
     state->hostSeeds = (int*)malloc(state->width * state->height * sizeof(int));
@@ -108,8 +295,26 @@ void initBuffers(AppState* state) {
         int random_value = rand();
         state->hostSeeds[i] = 1 + (random_value % 2147483646);
     }
-    state->cl_seedsBuffer = cl::Buffer(state->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, state->width * state->height * sizeof(int), state->hostSeeds);
+    state->cl_seedsBuffer = cl::Buffer(state->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, state->width * state->height * sizeof(int), state->hostSeeds);
+
+    //persistent threads work queue, the pixel count is padded to whole 8x8 swizzle tiles
+    state->cl_workCounter = cl::Buffer(state->context, CL_MEM_READ_WRITE, sizeof(cl_int));
+    int tilesX = (state->width + 7) / 8;
+    int tilesY = (state->height + 7) / 8;
+    state->persistentItems = tilesX * tilesY * 64;
+}
+
+// enough work groups to keep every compute unit busy, the kernel loops until the queue is empty
+void initPersistentLaunch(AppState* state) {
+
+    cl_uint computeUnits = state->device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    size_t maxLocal = state->persistentKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(state->device);
+
+    while (state->persistentLocalSize > maxLocal && state->persistentLocalSize > 1) {
+        state->persistentLocalSize /= 2;
+    }
 
+    state->persistentGlobalSize = computeUnits * state->persistentGroupsPerCU * state->persistentLocalSize;
 
 }
 
@@ -0,0 +1,89 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "sdlUtils.h"
+
+#include <fstream>
+
+
+// slots of cl_statTotals, match the STAT_ defines in common.cl
+enum StatTotal {
+    StatRays,
+    StatPaths,
+    StatBounces,
+    StatSky,
+    StatDepthLimit,
+    StatBoxTests,
+    StatSphereTests,
+    StatCount
+};
+
+const char* heatmapNames[] = { "image", "bounces", "intersection tests", "sky escapes", "depth limited paths" };
+const int heatmapModeCount = 5;
+
+void initStatsBuffers(AppState* state) {
+
+    //without --stats the kernels never touch these, they only need to be valid arguments
+    size_t pixels = state->rayStats ? (size_t)state->width * state->height : 1;
+    state->cl_pixelStatsBuffer = cl::Buffer(state->context, CL_MEM_READ_WRITE, pixels * sizeof(cl_uint4));
+    state->cl_statTotalsBuffer = cl::Buffer(state->context, CL_MEM_READ_WRITE, StatCount * sizeof(cl_ulong));
+}
+
+void resetStatTotals(AppState* state) {
+    state->queue.enqueueFillBuffer(state->cl_statTotalsBuffer, (cl_ulong)0, 0, StatCount * sizeof(cl_ulong));
+}
+
+// value of a per pixel counter (per sample) that maps to the top of the heatmap ramp
+float heatmapScale(const AppState* state, int mode) {
+    switch (mode) {
+    case 1:  return 5.0f;                                      //max bounces per path
+    case 2:  return std::max(1.0f, 2.0f * state->testsPerPath); //twice the frame average
+    default: return 1.0f;                                      //rates
+    }
+}
+
+// reads the frame's global totals and prints a summary every statsReportInterval frames
+void reportStats(AppState* state) {
+
+    cl_ulong totals[StatCount];
+    state->queue.enqueueReadBuffer(state->cl_statTotalsBuffer, CL_TRUE, 0, sizeof(totals), totals);
+
+    double paths = (double)std::max<cl_ulong>(totals[StatPaths], 1);
+    state->testsPerPath = (float)((totals[StatBoxTests] + totals[StatSphereTests]) / paths);
+
+    if (++state->statsFrames % state->statsReportInterval != 0) {
+        return;
+    }
+
+    std::cout << "rays cast: " << totals[StatRays]
+              << ", avg path length: " << totals[StatBounces] / paths
+              << ", sky escape rate: " << 100.0 * totals[StatSky] / paths << "%"
+              << ", depth limited: " << 100.0 * totals[StatDepthLimit] / paths << "%"
+              << ", box tests/path: " << totals[StatBoxTests] / paths
+              << ", sphere tests/path: " << totals[StatSphereTests] / paths << "\n";
+}
+
+// one line per pixel with the raw counters for the samples currently accumulated
+void dumpPixelStats(AppState* state, long long accumulatedSamples) {
+
+    std::vector<cl_uint4> counts((size_t)state->width * state->height);
+    state->queue.enqueueReadBuffer(state->cl_pixelStatsBuffer, CL_TRUE, 0, counts.size() * sizeof(cl_uint4), counts.data());
+
+    std::ofstream file(state->statsPath, std::ios::trunc);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open " << state->statsPath << "\n";
+        return;
+    }
+
+    file << "# samples per pixel: " << accumulatedSamples << "\n";
+    file << "x,y,bounces,intersection_tests,sky_escapes,depth_limited\n";
+    for (int y = 0; y < state->height; y++) {
+        for (int x = 0; x < state->width; x++) {
+            const cl_uint4& c = counts[(size_t)y * state->width + x];
+            file << x << "," << y << "," << c.x << "," << c.y << "," << c.z << "," << c.w << "\n";
+        }
+    }
+    std::cout << "Wrote per pixel stats to " << state->statsPath << "\n";
+}
+
+#endif
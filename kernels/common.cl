@@ -23,6 +23,89 @@ typedef struct __attribute__((packed)){
 
 } sphereInfo;
 
+// material of the sphere at the same index, a separate unpacked array so the float3s stay aligned
+typedef struct {
+	float3 albedo;
+	float3 emission;
+} materialInfo;
+
+typedef struct {
+	float3 center;
+	float3 emission;
+	float radius;
+	float cdf;
+	float pad[2];
+} lightInfo;
+
+// leaves have count >= 0 items from leftFirst, inner nodes have count -1 and children at leftFirst and leftFirst + 1
+typedef struct {
+	float3 boundsMin;
+	float3 boundsMax;
+	int leftFirst;
+	int count;
+	int pad[2];
+} bvhNode;
+
+typedef struct {
+	int firstSphere;
+	int sphereCount;
+	int rootNode;
+	int pad;
+} geometryInfo;
+
+typedef struct {
+	float3 rot0;
+	float3 rot1;
+	float3 rot2;
+	float3 translation;
+	float3 albedo;
+	float3 emission;
+	float scale;
+	int geometry;
+	int overrideMaterial;
+	int pad;
+} instanceInfo;
+
+// everything a ray can hit, the two level structure is instances (tlasNodes) over shared geometry (blasNodes)
+typedef struct {
+	__global const sphereInfo* spheres;
+	__global const materialInfo* materials;
+	__global const bvhNode* blasNodes;
+	__global const geometryInfo* geometries;
+	__global const instanceInfo* instances;
+	__global const bvhNode* tlasNodes;
+	__global const int* tlasIndices;
+	int numInstances;
+} sceneData;
+
+// Work counters for the instrumented build (-DRAY_STATS), COUNT compiles to nothing otherwise
+typedef struct {
+	uint rays;
+	uint paths;
+	uint bounces;
+	uint skyEscapes;
+	uint depthLimit;
+	uint boxTests;
+	uint sphereTests;
+} rayStats;
+
+// slots of the global totals buffer, match StatTotal in stats.h
+#define STAT_RAYS         0
+#define STAT_PATHS        1
+#define STAT_BOUNCES      2
+#define STAT_SKY          3
+#define STAT_DEPTH_LIMIT  4
+#define STAT_BOX_TESTS    5
+#define STAT_SPHERE_TESTS 6
+#define STAT_COUNT        7
+
+#ifdef RAY_STATS
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+#define COUNT(stats, field) ((stats)->field++)
+#else
+#define COUNT(stats, field)
+#endif
+
 inline float rand(int* seed) {
     int const a = 16807; 
     int const m = 2147483647; 
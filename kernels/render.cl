@@ -1,3 +1,106 @@
+// Storage formats, selected on the host through -DACCUM_FORMAT / -DOUTPUT_FORMAT
+#define ACCUM_FLOAT 0
+#define ACCUM_HALF  1
+#define ACCUM_RGBE  2
+
+#define OUTPUT_RGB24 0
+#define OUTPUT_RGBA8 1
+#define OUTPUT_BGRA8 2
+
+#ifndef ACCUM_FORMAT
+#define ACCUM_FORMAT ACCUM_FLOAT
+#endif
+
+#ifndef OUTPUT_FORMAT
+#define OUTPUT_FORMAT OUTPUT_RGB24
+#endif
+
+#if ACCUM_FORMAT == ACCUM_HALF
+typedef half accum_t;   // 4 halves (rgb + pad) per pixel, accessed with vload_half4/vstore_half4
+#elif ACCUM_FORMAT == ACCUM_RGBE
+typedef uint accum_t;   // 8 bit mantissas with a shared 8 bit exponent, only stored once per frame by ray_trace_persistent
+#else
+typedef float3 accum_t;
+#endif
+
+#if OUTPUT_FORMAT == OUTPUT_RGB24
+typedef uchar output_t;
+#else
+typedef uint output_t;  // one packed 32 bit store per pixel
+#endif
+
+inline uint encodeRGBE(float3 c) {
+    float m = fmax(c.x, fmax(c.y, c.z));
+    if (m < 1e-32f) {
+        return 0u;
+    }
+
+    int e;
+    frexp(m, &e);
+    float scale = ldexp(256.0f, -e);
+    uint3 q = min(convert_uint3(c * scale + 0.5f), (uint3)(255u));
+
+    return q.x | (q.y << 8) | (q.z << 16) | ((uint)(e + 128) << 24);
+}
+
+inline float3 decodeRGBE(uint v) {
+    uint e = v >> 24;
+    if (e == 0u) {
+        return (float3)(0.0f, 0.0f, 0.0f);
+    }
+
+    float f = ldexp(1.0f, (int)e - (128 + 8));
+    return (float3)((float)(v & 0xFFu), (float)((v >> 8) & 0xFFu), (float)((v >> 16) & 0xFFu)) * f;
+}
+
+inline float3 loadAccum(__global const accum_t* accum, int pixel_idx) {
+#if ACCUM_FORMAT == ACCUM_HALF
+    return vload_half4(pixel_idx, accum).xyz;
+#elif ACCUM_FORMAT == ACCUM_RGBE
+    return decodeRGBE(accum[pixel_idx]);
+#else
+    return accum[pixel_idx];
+#endif
+}
+
+inline void storeAccum(__global accum_t* accum, int pixel_idx, float3 value) {
+#if ACCUM_FORMAT == ACCUM_HALF
+    vstore_half4_rte((float4)(value, 0.0f), pixel_idx, accum);
+#elif ACCUM_FORMAT == ACCUM_RGBE
+    accum[pixel_idx] = encodeRGBE(value);
+#else
+    accum[pixel_idx] = value;
+#endif
+}
+
+inline void storeOutput(__global output_t* output, int pixel_idx, float3 color) {
+    uchar3 c = convert_uchar3_sat(color * 255.99f);
+#if OUTPUT_FORMAT == OUTPUT_RGB24
+    int dst_idx = pixel_idx * 3;
+    output[dst_idx + 0] = c.x;
+    output[dst_idx + 1] = c.y;
+    output[dst_idx + 2] = c.z;
+#elif OUTPUT_FORMAT == OUTPUT_RGBA8
+    output[pixel_idx] = (uint)c.x | ((uint)c.y << 8) | ((uint)c.z << 16) | 0xFF000000u;
+#else
+    output[pixel_idx] = (uint)c.z | ((uint)c.y << 8) | ((uint)c.x << 16) | 0xFF000000u;
+#endif
+}
+
+// black -> blue -> green -> yellow -> red for t in [0, 1]
+inline float3 heatColor(float t) {
+    const float3 stops[5] = {
+        (float3)(0.0f, 0.0f, 0.0f),
+        (float3)(0.0f, 0.0f, 1.0f),
+        (float3)(0.0f, 1.0f, 0.0f),
+        (float3)(1.0f, 1.0f, 0.0f),
+        (float3)(1.0f, 0.0f, 0.0f)
+    };
+    float x = clamp(t, 0.0f, 1.0f) * 4.0f;
+    int i = min((int)x, 3);
+    return mix(stops[i], stops[i + 1], x - (float)i);
+}
+
 inline float linearToGamma(float linear_component) {
     if (linear_component > 0.0f)
         return sqrt(linear_component);
@@ -47,127 +150,509 @@ inline bool hit_sphere(const ray r, float ray_tmin, float ray_tmax, sphereInfo s
     return true;
 }
 
-inline bool hitSomething(const ray r, float ray_tmin, float ray_tmax, hitRec* rec, __constant sphereInfo* spheresPointer, int numSpheres){
+// set on the host from bvhStackSize, which also checks that every BVH of the scene fits
+#ifndef BVH_STACK_SIZE
+#define BVH_STACK_SIZE 32
+#endif
+
+inline bool hitBounds(float3 origin, float3 invDir, float3 boundsMin, float3 boundsMax, float ray_tmin, float ray_tmax) {
+    float3 t0 = (boundsMin - origin) * invDir;
+    float3 t1 = (boundsMax - origin) * invDir;
+    float3 tNear = fmin(t0, t1);
+    float3 tFar = fmax(t0, t1);
+    float enter = fmax(ray_tmin, fmax(tNear.x, fmax(tNear.y, tNear.z)));
+    float exit = fmin(ray_tmax, fmin(tFar.x, fmin(tFar.y, tFar.z)));
+    return enter <= exit;
+}
+
+inline float3 rotateToWorld(instanceInfo instance, float3 v) {
+    return (float3)(dot(instance.rot0, v), dot(instance.rot1, v), dot(instance.rot2, v));
+}
+
+inline float3 rotateToObject(instanceInfo instance, float3 v) {
+    return instance.rot0 * v.x + instance.rot1 * v.y + instance.rot2 * v.z;
+}
+
+inline float3 instanceToWorld(instanceInfo instance, float3 p) {
+    return rotateToWorld(instance, p) * instance.scale + instance.translation;
+}
+
+// closest sphere of one geometry, r is in the geometry's object space and keeps the world t
+inline bool hitGeometry(const ray r, float ray_tmin, float* closestSoFar, hitRec* rec, int* hitSphere, sceneData scene, int rootNode, rayStats* stats){
+
+    float3 invDir = 1.0f / r.m_dir;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = rootNode;
 
     hitRec tempRec;
+    bool hitAnything = false;
+
+    while(stackSize > 0){
+        bvhNode node = scene.blasNodes[stack[--stackSize]];
+        COUNT(stats, boxTests);
+        if(!hitBounds(r.m_origin, invDir, node.boundsMin, node.boundsMax, ray_tmin, *closestSoFar)){
+            continue;
+        }
+
+        if(node.count >= 0){
+            for(int i = node.leftFirst; i < node.leftFirst + node.count; i++){
+                COUNT(stats, sphereTests);
+                if(hit_sphere(r, ray_tmin, *closestSoFar, scene.spheres[i], &tempRec)){
+                    hitAnything = true;
+                    *closestSoFar = tempRec.t;
+                    *rec = tempRec;
+                    *hitSphere = i;
+                }
+            }
+        }
+        else{
+            stack[stackSize++] = node.leftFirst;
+            stack[stackSize++] = node.leftFirst + 1;
+        }
+    }
+    return hitAnything;
+}
+
+// Walks the instance BVH, every instance leaf moves the ray into object space (t is unchanged) and walks that geometry's BVH.
+// rec comes back in world space, hitInstance/hitSphere say which sphere of which instance was hit.
+inline bool hitSomething(const ray r, float ray_tmin, float ray_tmax, hitRec* rec, int* hitInstance, int* hitSphere, sceneData scene, rayStats* stats){
+
+    if(scene.numInstances == 0){
+        return false;
+    }
+
+    float3 invDir = 1.0f / r.m_dir;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
     bool hitAnything = false;
     float closestSoFar = ray_tmax;
+    int closestInstance = 0;
+
+    while(stackSize > 0){
+        bvhNode node = scene.tlasNodes[stack[--stackSize]];
+        COUNT(stats, boxTests);
+        if(!hitBounds(r.m_origin, invDir, node.boundsMin, node.boundsMax, ray_tmin, closestSoFar)){
+            continue;
+        }
 
-    for(int i = 0; i < numSpheres; i++){
-        if(hit_sphere(r, ray_tmin, closestSoFar, spheresPointer[i], &tempRec)){
-            hitAnything = true;
-            closestSoFar = tempRec.t;
-            *rec = tempRec;
-            
+        if(node.count >= 0){
+            for(int k = node.leftFirst; k < node.leftFirst + node.count; k++){
+                int index = scene.tlasIndices[k];
+                instanceInfo instance = scene.instances[index];
+
+                float invScale = 1.0f / instance.scale;
+                ray objectRay = ray_new(rotateToObject(instance, r.m_origin - instance.translation) * invScale,
+                                        rotateToObject(instance, r.m_dir) * invScale);
+
+                if(hitGeometry(objectRay, ray_tmin, &closestSoFar, rec, hitSphere, scene, scene.geometries[instance.geometry].rootNode, stats)){
+                    hitAnything = true;
+                    closestInstance = index;
+                }
+            }
+        }
+        else{
+            stack[stackSize++] = node.leftFirst;
+            stack[stackSize++] = node.leftFirst + 1;
         }
     }
+
+    if(hitAnything){
+        rec->P = point3D_at(r, rec->t);
+        rec->normal = rotateToWorld(scene.instances[closestInstance], rec->normal);
+        *hitInstance = closestInstance;
+    }
     return hitAnything;
 
 }
 
-inline float3 rayColor(const ray r, float ray_tmin, float ray_tmax, __constant sphereInfo* spheresPointer, int numSpheres, int* seed){
+inline float luminance(float3 c) {
+    return dot(c, (float3)(0.2126f, 0.7152f, 0.0722f));
+}
+
+// chance of picking this light from the table, matches render::lightPower on the host
+inline float lightPickPdf(float3 emission, float radius, float totalLightPower) {
+    return luminance(emission) * 4.0f * M_PI_F * radius * radius / totalLightPower;
+}
+
+// cone of directions from p that hit the sphere, cosThetaMax is 1 (empty cone) when p is inside
+inline float sphereCosThetaMax(float3 p, float3 center, float radius) {
+    float3 toCenter = center - p;
+    float dist2 = dot(toCenter, toCenter);
+    float r2 = radius * radius;
+    if (dist2 <= r2) {
+        return 1.0f;
+    }
+    return sqrt(1.0f - r2 / dist2);
+}
+
+inline float sphereSolidAnglePdf(float3 p, float3 center, float radius) {
+    float cosThetaMax = sphereCosThetaMax(p, center, radius);
+    if (cosThetaMax >= 1.0f) {
+        return 0.0f;
+    }
+    return 1.0f / (2.0f * M_PI_F * (1.0f - cosThetaMax));
+}
+
+inline float3 sampleCone(float3 axis, float cosThetaMax, int* seed) {
+    float3 helper = fabs(axis.x) > 0.9f ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f);
+    float3 v = normalize(cross(axis, helper));
+    float3 u = cross(v, axis);
+
+    float cosTheta = 1.0f - rand(seed) * (1.0f - cosThetaMax);
+    float sinTheta = sqrt(fmax(0.0f, 1.0f - cosTheta * cosTheta));
+    float phi = 2.0f * M_PI_F * rand(seed);
+
+    return u * (cos(phi) * sinTheta) + v * (sin(phi) * sinTheta) + axis * cosTheta;
+}
+
+// nearest positive distance to a sphere along a normalized direction, -1 on a miss
+inline float sphereDistance(float3 origin, float3 dir, float3 center, float radius) {
+    float3 oc = center - origin;
+    float h = dot(dir, oc);
+    float discriminant = h*h - (dot(oc, oc) - radius*radius);
+    if (discriminant < 0.0f) {
+        return -1.0f;
+    }
+    float sqrtd = sqrt(discriminant);
+    return (h - sqrtd) > 0.0f ? (h - sqrtd) : (h + sqrtd);
+}
+
+inline int pickLight(__constant lightInfo* lights, int numLights, float u) {
+    int lo = 0;
+    int hi = numLights - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (u < lights[mid].cdf) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+inline float powerHeuristic(float pdfA, float pdfB) {
+    float a2 = pdfA * pdfA;
+    float b2 = pdfB * pdfB;
+    return a2 / (a2 + b2);
+}
+
+// shadow ray towards one light from the table, weighted against the diffuse bounce sampling the same direction
+// at the last vertex no bounce is traced, so the light sample carries the full weight
+inline float3 sampleDirectLight(hitRec rec, float3 albedo, float ray_tmin, sceneData scene,
+                                __constant lightInfo* lights, int numLights, float totalLightPower, int lastVertex, int* seed, rayStats* stats) {
+
+    lightInfo light = lights[pickLight(lights, numLights, rand(seed))];
+
+    float cosThetaMax = sphereCosThetaMax(rec.P, light.center, light.radius);
+    if (cosThetaMax >= 1.0f) {
+        return (float3)(0.0f, 0.0f, 0.0f);
+    }
+
+    float3 wi = sampleCone(normalize(light.center - rec.P), cosThetaMax, seed);
+    float cosTheta = dot(rec.normal, wi);
+    float tLight = sphereDistance(rec.P, wi, light.center, light.radius);
+    if (cosTheta <= 0.0f || tLight <= 0.0f) {
+        return (float3)(0.0f, 0.0f, 0.0f);
+    }
+
+    hitRec shadowRec;
+    int shadowInstance, shadowSphere;
+    COUNT(stats, rays);
+    if (hitSomething(ray_new(rec.P, wi), ray_tmin, tLight * 0.999f, &shadowRec, &shadowInstance, &shadowSphere, scene, stats)) {
+        return (float3)(0.0f, 0.0f, 0.0f);
+    }
+
+    float lightPdf = lightPickPdf(light.emission, light.radius, totalLightPower) / (2.0f * M_PI_F * (1.0f - cosThetaMax));
+    float bsdfPdf = cosTheta / M_PI_F;
+    float3 bsdf = albedo / M_PI_F;
+    float weight = lastVertex ? 1.0f : powerHeuristic(lightPdf, bsdfPdf);
+
+    return bsdf * light.emission * (cosTheta * weight / lightPdf);
+}
+
+#define MAX_BOUNCES 5
+
+inline float3 rayColor(const ray r, float ray_tmin, float ray_tmax, sceneData scene,
+                       __constant lightInfo* lights, int numLights, float totalLightPower, int* seed, rayStats* stats){
 
     ray currentRay = r;
 
     hitRec rec;
+    int hitInstance, hitSphere;
 
     float3 color = (float3)(1, 1, 1); //start at full intensity
+    float3 radiance = (float3)(0, 0, 0);
+    float bsdfPdf = 0.0f; //pdf of the bounce that produced currentRay, 0 for camera rays
 
-    for(int bounce = 0; bounce < 5; bounce++){
-        if(!hitSomething(currentRay, ray_tmin, ray_tmax, &rec, spheresPointer, numSpheres)){
+    COUNT(stats, paths);
 
+    for(int bounce = 0; bounce < MAX_BOUNCES; bounce++){
+        COUNT(stats, rays);
+        if(!hitSomething(currentRay, ray_tmin, ray_tmax, &rec, &hitInstance, &hitSphere, scene, stats)){
+
+            COUNT(stats, skyEscapes);
             float3 unit_direction = normalize(currentRay.m_dir);
             float a = 0.5f * (unit_direction.y + 1.0f);
-            return color * ((float3)(1.0f, 1.0f, 1.0f) * (1.0f - a) + (float3)(0.5f, 0.7f, 1.0f) * a);
+            return radiance + color * ((float3)(1.0f, 1.0f, 1.0f) * (1.0f - a) + (float3)(0.5f, 0.7f, 1.0f) * a);
 
         }
-        else{
-            float3 dir = rec.normal + randomUnitFloat3(seed);
-            currentRay = ray_new(rec.P, dir);
 
-            if(rec.objID == 1){
-                color *= (float3)(0.2f, 0.5f, 0.0f);
-            }
-            else if (rec.objID == 2){
-                color *= 0.5f;
+        COUNT(stats, bounces);
+
+        instanceInfo instance = scene.instances[hitInstance];
+        sphereInfo sphere = scene.spheres[hitSphere];
+        materialInfo material = scene.materials[hitSphere];
+        float3 albedo = instance.overrideMaterial ? instance.albedo : material.albedo;
+        float3 emission = instance.overrideMaterial ? instance.emission : material.emission;
+
+        //emitter found by the bounce, light sampling could have found it too
+        if(rec.front_face && any(emission > 0.0f)){
+            float weight = 1.0f;
+            if(bsdfPdf > 0.0f){
+                float radius = sphere.m_radius * instance.scale;
+                float lightPdf = lightPickPdf(emission, radius, totalLightPower)
+                               * sphereSolidAnglePdf(currentRay.m_origin, instanceToWorld(instance, sphere.m_center), radius);
+                weight = powerHeuristic(bsdfPdf, lightPdf);
             }
+            radiance += color * emission * weight;
+        }
+
+        if(numLights > 0){
+            radiance += color * sampleDirectLight(rec, albedo, ray_tmin, scene, lights, numLights, totalLightPower,
+                                                  bounce == MAX_BOUNCES - 1, seed, stats);
+        }
+
+        float3 dir = rec.normal + randomUnitFloat3(seed);
+        currentRay = ray_new(rec.P, dir);
+        bsdfPdf = fmax(dot(rec.normal, normalize(dir)), 0.0f) / M_PI_F;
+
+        color *= albedo;
+
+        //zero throughput (black albedo, like the light) ends the path, later vertices cannot add radiance
+        if(all(color == 0.0f)){
+            return radiance;
         }
     }
-    return (float3)(0.0f, 0.0f, 0.0f);
+    COUNT(stats, depthLimit);
+    return radiance;
 }
 
 
 
 
-__kernel void ray_trace(int task, __global float3* accum, int width, int height, __constant cameraInfo* cameraPtr, 
-                        __constant sphereInfo* spheresPointer, int numSpheres, __global int* seed_memory, 
-                        __global float* debug, __global uchar* output, int maxSamples, int samplesPerThread) {
+// one batch of samples for pixel (i, j), advances the pixel's seed
+inline float3 tracePixel(int i, int j, int samplesPerThread, cameraInfo cam, sceneData scene,
+                         __constant lightInfo* lights, int numLights, float totalLightPower, int* seed, rayStats* stats) {
+
+    float3 pixel00 = cam.pixel00;
+    float3 delta_u = cam.delta_u;
+    float3 delta_v = cam.delta_v;
+    float3 cameraCenter = cam.camera_center;
+
+
+
+    float3 pixelCenter;
+    ray newRay;
+    float3 pixel_color = (float3)(0.0f, 0.0f, 0.0f);
+
+    for(int sample = 0; sample < samplesPerThread; sample++){
+
+        pixelCenter = pixel00 + (delta_u * ((float)i + rand(seed) + 0.5f)) + (delta_v * ((float)j + rand(seed) + 0.5f));
+        
+        newRay.m_origin = pixelCenter;
+        newRay.m_dir = pixelCenter - cameraCenter;
+        pixel_color += rayColor(newRay, 0.001f, 100000000.0f, scene, lights, numLights, totalLightPower, seed, stats);
+
+    }
+
+    return pixel_color;
+}
+
+// adds one work item's counters to its pixel (bounces, intersection tests, sky escapes, depth limited paths)
+inline void recordPixelStats(__global uint4* pixelStats, int pixel_idx, rayStats stats, int accumulate) {
+#ifdef RAY_STATS
+    uint4 counts = (uint4)(stats.bounces, stats.boxTests + stats.sphereTests, stats.skyEscapes, stats.depthLimit);
+    pixelStats[pixel_idx] = accumulate ? pixelStats[pixel_idx] + counts : counts;
+#endif
+}
+
+// Sums the work group's counters in local memory, then adds them to the global totals with one 64 bit atomic per counter and group.
+// Has barriers, every work item of the group must call it. groupStats holds STAT_COUNT entries.
+inline void recordStatTotals(__global ulong* statTotals, __local uint* groupStats, rayStats stats) {
+#ifdef RAY_STATS
+    int lid = get_local_id(1) * get_local_size(0) + get_local_id(0);
+    int groupSize = get_local_size(0) * get_local_size(1);
+
+    for(int k = lid; k < STAT_COUNT; k += groupSize){
+        groupStats[k] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    atomic_add(&groupStats[STAT_RAYS], stats.rays);
+    atomic_add(&groupStats[STAT_PATHS], stats.paths);
+    atomic_add(&groupStats[STAT_BOUNCES], stats.bounces);
+    atomic_add(&groupStats[STAT_SKY], stats.skyEscapes);
+    atomic_add(&groupStats[STAT_DEPTH_LIMIT], stats.depthLimit);
+    atomic_add(&groupStats[STAT_BOX_TESTS], stats.boxTests);
+    atomic_add(&groupStats[STAT_SPHERE_TESTS], stats.sphereTests);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(int k = lid; k < STAT_COUNT; k += groupSize){
+        atom_add(&statTotals[k], (ulong)groupStats[k]);
+    }
+#endif
+}
+
+__kernel void ray_trace(int task, __global accum_t* accum, int width, int height, __constant cameraInfo* cameraPtr, 
+                        __global const sphereInfo* spheresPointer, int numInstances, __global int* seed_memory, 
+                        __global float* debug, __global output_t* output, int maxSamples, int samplesPerThread,
+                        __constant lightInfo* lights, int numLights, float totalLightPower,
+                        __global const bvhNode* blasNodes, __global const geometryInfo* geometries, __global const instanceInfo* instances,
+                        __global const bvhNode* tlasNodes, __global const int* tlasIndices,
+                        __global uint4* pixelStats, __global ulong* statTotals, int heatmapMode, float heatmapScale,
+                        __global const materialInfo* materials) {
 
 
 
     int i = get_global_id(0);
     int j = get_global_id(1);
     int pixel_idx = j * width + i;          
-    int dst_idx = pixel_idx * 3;  
     int lid = get_local_id(0);
 
-
+    __local uint groupStats[STAT_COUNT];
+    rayStats stats = { 0, 0, 0, 0, 0, 0, 0 };
 
     if (i < width && j < height) {
 
         if(task == 0){
-            accum[pixel_idx] = (float3)(0, 0, 0); 
+            storeAccum(accum, pixel_idx, (float3)(0, 0, 0));
+#ifdef RAY_STATS
+            pixelStats[pixel_idx] = (uint4)(0u, 0u, 0u, 0u);
+#endif
             return;
         }
 
         if(task == 2){
 
             float inv = 1.0f / (float)maxSamples;
-            float3 avg = accum[pixel_idx] * inv;
+
+#ifdef RAY_STATS
+            //heatmap of one per pixel counter, per sample and relative to heatmapScale
+            if(heatmapMode > 0){
+                uint4 counts = pixelStats[pixel_idx];
+                uint value = heatmapMode == 1 ? counts.x : heatmapMode == 2 ? counts.y : heatmapMode == 3 ? counts.z : counts.w;
+                storeOutput(output, pixel_idx, heatColor((float)value * inv / heatmapScale));
+                return;
+            }
+#endif
+            float3 avg = loadAccum(accum, pixel_idx) * inv;
             float3 g  = (float3)(
                 linearToGamma(avg.x),
                 linearToGamma(avg.y),
                 linearToGamma(avg.z)
             );
-            output[dst_idx + 0] = (uchar)(g.x*255.99f);
-            output[dst_idx + 1] = (uchar)(g.y*255.99f);
-            output[dst_idx + 2] = (uchar)(g.z*255.99f);
+            storeOutput(output, pixel_idx, g);
 
 
             return;
         }
 
-        int global_id = j * get_global_size(0) + i;
         int seed = seed_memory[pixel_idx];
 
-    
+        sceneData scene = { spheresPointer, materials, blasNodes, geometries, instances, tlasNodes, tlasIndices, numInstances };
+
+        float3 sum = tracePixel(i, j, samplesPerThread, cameraPtr[0], scene, lights, numLights, totalLightPower, &seed, &stats);
+
+        seed_memory[pixel_idx] = seed;
+        recordPixelStats(pixelStats, pixel_idx, stats, 1);
+
+        storeAccum(accum, pixel_idx, loadAccum(accum, pixel_idx) + sum);
+    }
 
-        cameraInfo cam = cameraPtr[0];
-        float3 pixel00 = cam.pixel00;
-        float3 delta_u = cam.delta_u;
-        float3 delta_v = cam.delta_v;
-        float3 cameraCenter = cam.camera_center;
+    //the whole group takes part, padding work items outside the image add zeros; the other tasks returned above or skip it here
+    if(task == 1){
+        recordStatTotals(statTotals, groupStats, stats);
+    }
+}
 
+// keeps every other bit, undoing the interleave of a morton code
+inline uint compactBits(uint x) {
+    x &= 0x55555555u;
+    x = (x | (x >> 1)) & 0x33333333u;
+    x = (x | (x >> 2)) & 0x0F0F0F0Fu;
+    x = (x | (x >> 4)) & 0x00FF00FFu;
+    x = (x | (x >> 8)) & 0x0000FFFFu;
+    return x;
+}
 
+#define SWIZZLE_TILE 8
 
-        float3 pixelCenter;
-        ray newRay;
-        float3 pixel_color = (float3)(0.0f, 0.0f, 0.0f);
+// work item -> pixel, 8x8 tiles in row order, morton order inside a tile
+inline int2 swizzledPixel(int item, int width) {
+    int tilesX = (width + SWIZZLE_TILE - 1) / SWIZZLE_TILE;
+    int tile = item / (SWIZZLE_TILE * SWIZZLE_TILE);
+    uint inTile = (uint)(item % (SWIZZLE_TILE * SWIZZLE_TILE));
 
-        for(int sample = 0; sample < samplesPerThread; sample++){
+    return (int2)((tile % tilesX) * SWIZZLE_TILE + (int)compactBits(inTile),
+                  (tile / tilesX) * SWIZZLE_TILE + (int)compactBits(inTile >> 1));
+}
 
-            pixelCenter = pixel00 + (delta_u * ((float)i + rand(&seed) + 0.5f)) + (delta_v * ((float)j + rand(&seed) + 0.5f));
-            
-            newRay.m_origin = pixelCenter;
-            newRay.m_dir = pixelCenter - cameraCenter;
-            pixel_color += rayColor(newRay, 0.001f, 100000000.0f, spheresPointer, numSpheres, &seed);
+// Persistent threads: launched once per frame with just enough work groups to fill the device.
+// Each group pulls the next get_local_size(0) pixels from workCounter and traces all batches of the frame for them,
+// so the accumulation buffer is written once and no clear pass is needed.
+// With accumulate set the frame is added to what is already in accum (progressive rendering).
+__kernel void ray_trace_persistent(__global accum_t* accum, int width, int height, __constant cameraInfo* cameraPtr,
+                                   __global const sphereInfo* spheresPointer, int numInstances, __global int* seed_memory,
+                                   int batches, int samplesPerThread, __constant lightInfo* lights, int numLights, float totalLightPower,
+                                   __global int* workCounter, int totalItems, int accumulate,
+                                   __global const bvhNode* blasNodes, __global const geometryInfo* geometries, __global const instanceInfo* instances,
+                                   __global const bvhNode* tlasNodes, __global const int* tlasIndices,
+                                   __global uint4* pixelStats, __global ulong* statTotals, __global const materialInfo* materials) {
 
+    __local int groupBase;
+    __local uint groupStats[STAT_COUNT];
+
+    cameraInfo cam = cameraPtr[0];
+    sceneData scene = { spheresPointer, materials, blasNodes, geometries, instances, tlasNodes, tlasIndices, numInstances };
+
+    for (;;) {
+
+        if (get_local_id(0) == 0) {
+            groupBase = atomic_add(workCounter, (int)get_local_size(0));
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        int base = groupBase;
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-        seed_memory[pixel_idx] = seed;
+        if (base >= totalItems) {
+            break;
+        }
+
+        int2 pixel = swizzledPixel(base + (int)get_local_id(0), width);
+        rayStats stats = { 0, 0, 0, 0, 0, 0, 0 };
+
+        if (pixel.x < width && pixel.y < height) {
+
+            int pixel_idx = pixel.y * width + pixel.x;
+            int seed = seed_memory[pixel_idx];
+
+            // summed batch by batch like the launches in ray_trace, so float accumulation gives the same result in both modes
+            float3 sum = accumulate ? loadAccum(accum, pixel_idx) : (float3)(0.0f, 0.0f, 0.0f);
+            for (int batch = 0; batch < batches; batch++) {
+                sum += tracePixel(pixel.x, pixel.y, samplesPerThread, cam, scene, lights, numLights, totalLightPower, &seed, &stats);
+            }
+
+            seed_memory[pixel_idx] = seed;
+            recordPixelStats(pixelStats, pixel_idx, stats, accumulate);
+            storeAccum(accum, pixel_idx, sum);
+        }
 
-        float3 sum = (float3)(pixel_color.x, pixel_color.y, pixel_color.z);
-        accum[pixel_idx] += sum;
+        //flushed once per group and queue step, a group's sums over one pixel each stay well inside 32 bits
+        recordStatTotals(statTotals, groupStats, stats);
     }
-    
 }
@@ -12,15 +12,27 @@
 #include "render.h"
 #include "embedded_kernels.h" 
 #include "sdlUtils.h"
+#include "renderThread.h"
+#include "autotune.h"
 
 
 SDL_AppResult SDL_AppInit(void** appstate, int argc, char** argv) {
     auto* state = new AppState;
+    // SDL_AppQuit runs after a failed init too and cleans up whatever was created so far
+    *appstate = state;
+    parseArgs(state, argc, argv);
+
+    // traversal stacks are sized when the kernels compile, a deeper BVH would silently lose subtrees
+    int depth = state->renderScene.maxBVHDepth();
+    if (depth + 1 > bvhStackSize) {
+        std::cerr << "Scene BVH is " << depth << " levels deep, the kernels' traversal stack holds " << bvhStackSize << " entries\n";
+        return SDL_APP_FAILURE;
+    }
 
     state->window = SDL_CreateWindow("Ray Tracer", state->width * state->widthCorrector, state->height * state->heightCorrector, 0);
     state->renderer = SDL_CreateRenderer(state->window, nullptr);
-    state->texture = SDL_CreateTexture(state->renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, state->width, state->height);
-    state->pixels.resize(state->width * state->height * 3);
+    state->texture = SDL_CreateTexture(state->renderer, sdlPixelFormat(state->outputFormat), SDL_TEXTUREACCESS_STREAMING, state->width, state->height);
+    state->frameMailbox.fill(std::vector<uchar>(state->width * state->height * outputBytesPerPixel(state->outputFormat)));
     cl::Program program;
     try {
         std::vector<cl::Platform> platforms;
@@ -38,14 +50,21 @@ SDL_AppResult SDL_AppInit(void** appstate, int argc, char** argv) {
         }
 
         state->device = devices[0];
+
+        // the ray totals of the instrumented build are 64 bit atomics
+        if (state->rayStats && state->device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_int64_base_atomics") == std::string::npos) {
+            std::cerr << "--stats needs cl_khr_int64_base_atomics, which " << state->device.getInfo<CL_DEVICE_NAME>() << " does not support\n";
+            return SDL_APP_FAILURE;
+        }
+
         state->context = cl::Context({ state->device });
-        state->queue = cl::CommandQueue(state->context, state->device);
+        state->queue = cl::CommandQueue(state->context, state->device, state->autotune ? CL_QUEUE_PROFILING_ENABLE : 0);
 
         std::string ray_trace_kernel =
             Kernels::common_cl + "\n" + Kernels::ray_cl + "\n" + Kernels::render_cl;
 
         program = cl::Program(state->context, ray_trace_kernel);
-        cl_int err = program.build({ state->device });
+        cl_int err = program.build({ state->device }, kernelBuildOptions(state).c_str());
         if (err != CL_SUCCESS) {
             std::string buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(state->device);
             std::cerr << "Build failed:\n" << buildLog << std::endl;
@@ -53,8 +72,28 @@ SDL_AppResult SDL_AppInit(void** appstate, int argc, char** argv) {
         }
 
         state->kernel = cl::Kernel(program, "ray_trace");
+        state->persistentKernel = cl::Kernel(program, "ray_trace_persistent");
 
         initBuffers(state);
+        initStatsBuffers(state);
+
+        if (state->autotune) {
+            autotune(state);
+        }
+        else if (loadTuneProfile(state)) {
+            std::cout << "Loaded launch profile: local " << state->localX << "x" << state->localY << ", " << state->samplesPerThread << " samples/launch";
+            if (state->persistentThreads) {
+                std::cout << ", persistent " << state->persistentGroupsPerCU << " groups of " << state->persistentLocalSize << " per compute unit";
+            }
+            std::cout << "\n";
+        }
+        fitLocalSize(state);
+        initPersistentLaunch(state);
+
+        // a failed resume must not go on and overwrite the checkpoint the user asked for
+        if (!state->resumePath.empty() && !loadCheckpoint(state)) {
+            return SDL_APP_FAILURE;
+        }
         std::cout << "OpenCL initialized successfully!\n";
     }
     catch (cl::Error& e) {
@@ -67,7 +106,9 @@ SDL_AppResult SDL_AppInit(void** appstate, int argc, char** argv) {
         return SDL_APP_FAILURE;
     }
 
-    *appstate = state;
+    state->cameraMailbox.fill(CameraUpdate{ state->renderScene.cameraInfo, state->renderScene.cam.lookfrom, state->renderScene.cam.lookat });
+    state->renderThread = std::thread(renderThreadMain, state);
+
     return SDL_APP_CONTINUE;
 }
 
@@ -89,64 +130,26 @@ SDL_AppResult SDL_AppIterate(void* appstate){
     }
     lastTime = currentTime;
 
-    try {
-        cl::NDRange local(64, 4);
-        cl::NDRange global_size(state->width, state->height);
-
-        state->kernel.setArg(0, 0);
-        state->kernel.setArg(1, state->cl_AccumBuffer);
-        state->kernel.setArg(2, state->width);
-        state->kernel.setArg(3, state->height);
-        state->kernel.setArg(4, state->cl_cameraBuffer);
-        state->kernel.setArg(5, state->cl_spheresBuffer);
-        state->kernel.setArg(6, state->numSpheres);
-        state->kernel.setArg(7, state->cl_seedsBuffer);
-        state->kernel.setArg(8, state->cl_debugBuffer);
-        state->kernel.setArg(9, state->cl_output);
-        state->kernel.setArg(10, state->maxSamples);
-        state->kernel.setArg(11, state->samplesPerThread);
-        
-
-
-        state->queue.enqueueNDRangeKernel(state->kernel, cl::NullRange, global_size, local);
-
-
-        state->kernel.setArg(0, 1);
-        for (int sample = 0; sample < state->maxSamples/state->samplesPerThread; sample++) {
-            state->queue.enqueueNDRangeKernel(state->kernel, cl::NullRange, global_size, local);
-        }
-        if (state->cameraNeedsUpdate) {
-            state->renderScene.buildCamStruct();
-            state->queue.enqueueWriteBuffer(state->cl_cameraBuffer, CL_TRUE, 0, sizeof(state->renderScene.cameraInfo), &state->renderScene.cameraInfo);
-            state->cameraNeedsUpdate = false;
-        }
-        state->kernel.setArg(0, 2);
-        state->queue.enqueueNDRangeKernel(state->kernel, cl::NullRange, global_size, local);
-
-
-        state->queue.enqueueReadBuffer(state->cl_output, CL_TRUE, 0, state->width * state->height * sizeof(uchar) * 3, state->pixels.data());
-        state->queue.finish();
-
-
+    //show the newest finished frame from the render thread, if there is one
+    if (state->frameMailbox.fetch()) {
 
         void* texPixels;
         int pitch;
         if (SDL_LockTexture(state->texture, nullptr, &texPixels, &pitch) == 1) {
 
-            uchar* src = state->pixels.data();
+            size_t rowBytes = state->width * outputBytesPerPixel(state->outputFormat);
+            uchar* src = state->frameMailbox.readBuffer().data();
             uchar* dst = (uchar*)texPixels;
             for (int y = 0; y < state->height; y++) {
-                memcpy(dst, src, state->width * 3);
-                src += state->width * 3;
+                memcpy(dst, src, rowBytes);
+                src += rowBytes;
                 dst += pitch;
             }
             SDL_UnlockTexture(state->texture);
         }
-
     }
-    catch (const cl::Error& e) {
-        std::cerr << "OpenCL runtime error: " << e.what() << " (code: " << e.err() << ")" << std::endl;
-        std::cout << "Kernel expects " << state->kernel.getInfo<CL_KERNEL_NUM_ARGS>() << " arguments" << std::endl;
+    else {
+        SDL_Delay(1);
     }
 
     SDL_RenderClear(state->renderer);
@@ -191,6 +194,18 @@ SDL_AppResult SDL_AppEvent(void* appstate, SDL_Event* event){
         std::cout << "left click\n";
     }
 
+    //stats build: H cycles the heatmap, P writes the per pixel counters to a file
+    else if (event->type == SDL_EVENT_KEY_DOWN && state->rayStats && !event->key.repeat) {
+        if (event->key.key == SDLK_H) {
+            int mode = (state->heatmapMode + 1) % heatmapModeCount;
+            state->heatmapMode = mode;
+            std::cout << "showing " << heatmapNames[mode] << "\n";
+        }
+        else if (event->key.key == SDLK_P) {
+            state->dumpStatsRequested = true;
+        }
+    }
+
     else if (event->type == SDL_EVENT_MOUSE_MOTION ) {
         
         if (state->moving && !state->ignoringEvents) {
@@ -204,7 +219,11 @@ SDL_AppResult SDL_AppEvent(void* appstate, SDL_Event* event){
                 state->renderScene.cam.updateCamera(updateDelta, state->heightCorrector);
                 state->currentVirtualX += deltaX;
                 state->currentVirtualY += deltaY;
-                state->cameraNeedsUpdate = true;
+
+                //the render thread drops its current frame as soon as this is published
+                state->renderScene.buildCamStruct();
+                state->cameraMailbox.writeBuffer() = CameraUpdate{ state->renderScene.cameraInfo, state->renderScene.cam.lookfrom, state->renderScene.cam.lookat };
+                state->cameraMailbox.publish();
 
                 state->ignoringEvents = true;
                 SDL_WarpMouseInWindow(state->window, state->windowCenterX, state->windowCenterY);
@@ -223,6 +242,11 @@ void SDL_AppQuit(void* appstate, SDL_AppResult result)
 {
     AppState* state = (AppState*)appstate;
 
+    state->quitRender = true;
+    if (state->renderThread.joinable()) {
+        state->renderThread.join();
+    }
+
     SDL_DestroyTexture(state->texture);
     SDL_DestroyRenderer(state->renderer);
     SDL_DestroyWindow(state->window);